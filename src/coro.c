@@ -0,0 +1,362 @@
+#include "coro.h"
+#include "queue.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+typedef struct reactor reactor_t;
+
+typedef struct coro {
+  ucontext_t ctx;
+  void *stack; // Mapping base, the guard page sits at the bottom
+  int client_socket;
+  reactor_t *reactor;
+  int wait_fd;      // fd registered with epoll while waiting, -1 otherwise
+  uint64_t deadline; // Monotonic ms, valid while heap_index != -1
+  int heap_index;
+  int timed_out;
+  int done;
+} coro_t;
+
+struct reactor {
+  pthread_t thread;
+  int epoll_fd;
+  int wakeup_fd; // eventfd, signalled when sockets are queued
+  task_queue_t *incoming;
+  pthread_mutex_t incoming_mutex;
+  ucontext_t ctx; // Scheduler context coroutines yield back to
+  coro_t **timers; // Min-heap on deadline
+  int timer_count;
+  int timer_capacity;
+  void *free_stacks[CORO_STACK_POOL];
+  int free_stack_count;
+  int coro_count; // Coroutines alive on this reactor
+};
+
+static reactor_t *reactors = NULL;
+static int reactor_count = 0;
+static unsigned int next_reactor = 0;
+static coro_handler_t coro_handler = NULL;
+static volatile int stop = 0;
+static size_t page_size = 0;
+
+static __thread coro_t *current = NULL; // Running coroutine on this thread
+
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Timer heap
+
+static void heap_swap(reactor_t *r, int a, int b) {
+  coro_t *tmp = r->timers[a];
+  r->timers[a] = r->timers[b];
+  r->timers[b] = tmp;
+  r->timers[a]->heap_index = a;
+  r->timers[b]->heap_index = b;
+}
+
+static void heap_sift(reactor_t *r, int i) {
+  while (i > 0 && r->timers[(i - 1) / 2]->deadline > r->timers[i]->deadline) {
+    heap_swap(r, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  while (1) {
+    int smallest = i;
+    int left = 2 * i + 1, right = 2 * i + 2;
+    if (left < r->timer_count &&
+        r->timers[left]->deadline < r->timers[smallest]->deadline)
+      smallest = left;
+    if (right < r->timer_count &&
+        r->timers[right]->deadline < r->timers[smallest]->deadline)
+      smallest = right;
+    if (smallest == i)
+      break;
+    heap_swap(r, i, smallest);
+    i = smallest;
+  }
+}
+
+static int timer_add(reactor_t *r, coro_t *coro, uint64_t deadline) {
+  if (r->timer_count == r->timer_capacity) {
+    int capacity = r->timer_capacity ? r->timer_capacity * 2 : 64;
+    coro_t **timers = realloc(r->timers, capacity * sizeof(coro_t *));
+    if (timers == NULL) {
+      return -1;
+    }
+    r->timers = timers;
+    r->timer_capacity = capacity;
+  }
+  coro->deadline = deadline;
+  coro->heap_index = r->timer_count;
+  r->timers[r->timer_count++] = coro;
+  heap_sift(r, coro->heap_index);
+  return 0;
+}
+
+static void timer_remove(reactor_t *r, coro_t *coro) {
+  int i = coro->heap_index;
+  if (i == -1) {
+    return;
+  }
+  coro->heap_index = -1;
+  r->timer_count--;
+  if (i != r->timer_count) {
+    r->timers[i] = r->timers[r->timer_count];
+    r->timers[i]->heap_index = i;
+    heap_sift(r, i);
+  }
+}
+
+// Stacks, mmap'd with a guard page so an overflow faults instead of
+// corrupting a neighbour. Released stacks are pooled for the next coroutine
+
+static void *stack_alloc(reactor_t *r) {
+  if (r->free_stack_count > 0) {
+    return r->free_stacks[--r->free_stack_count];
+  }
+  void *mem = mmap(NULL, CORO_STACK_SIZE + page_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (mem == MAP_FAILED) {
+    return NULL;
+  }
+  mprotect(mem, page_size, PROT_NONE);
+  return mem;
+}
+
+static void stack_release(reactor_t *r, void *stack) {
+  if (r->free_stack_count < CORO_STACK_POOL) {
+    r->free_stacks[r->free_stack_count++] = stack;
+  } else {
+    munmap(stack, CORO_STACK_SIZE + page_size);
+  }
+}
+
+// Scheduling
+
+static void coro_entry() {
+  coro_t *coro = current;
+  coro_handler(coro->client_socket);
+  coro->done = 1;
+  // Returning resumes uc_link, the reactor's context
+}
+
+static void resume(reactor_t *r, coro_t *coro) {
+  current = coro;
+  swapcontext(&r->ctx, &coro->ctx);
+  current = NULL;
+
+  if (coro->done) {
+    stack_release(r, coro->stack);
+    free(coro);
+    r->coro_count--;
+  }
+}
+
+static void spawn(reactor_t *r, int client_socket) {
+  coro_t *coro = calloc(1, sizeof(coro_t));
+  void *stack = coro ? stack_alloc(r) : NULL;
+  if (stack == NULL) {
+    fprintf(stderr, "Failed to allocate coroutine\n");
+    free(coro);
+    close(client_socket);
+    return;
+  }
+
+  coro->stack = stack;
+  coro->client_socket = client_socket;
+  coro->reactor = r;
+  coro->wait_fd = -1;
+  coro->heap_index = -1;
+
+  getcontext(&coro->ctx);
+  coro->ctx.uc_stack.ss_sp = (char *)stack + page_size;
+  coro->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+  coro->ctx.uc_link = &r->ctx;
+  makecontext(&coro->ctx, coro_entry, 0);
+
+  r->coro_count++;
+  resume(r, coro); // Run until its first wait
+}
+
+static void yield() { swapcontext(&current->ctx, &current->reactor->ctx); }
+
+int coro_active() { return current != NULL; }
+
+// Park the coroutine until fd reports events (EPOLLIN/EPOLLOUT) or the
+// timeout passes. Returns 0 when ready, -1 on timeout or error
+int coro_await_fd(int fd, int events, int timeout_ms) {
+  coro_t *coro = current;
+  reactor_t *r = coro->reactor;
+
+  struct epoll_event ev = {.events = events | EPOLLONESHOT, .data.ptr = coro};
+  if (epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, fd, &ev) != 0) {
+    if (errno != ENOENT || epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      return -1;
+    }
+  }
+  coro->wait_fd = fd;
+  coro->timed_out = 0;
+  if (timeout_ms >= 0 && timer_add(r, coro, now_ms() + timeout_ms) != 0) {
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    coro->wait_fd = -1;
+    return -1;
+  }
+
+  yield();
+
+  coro->wait_fd = -1;
+  return coro->timed_out ? -1 : 0;
+}
+
+void coro_sleep(int timeout_ms) {
+  coro_t *coro = current;
+  if (timer_add(coro->reactor, coro, now_ms() + timeout_ms) == 0) {
+    yield();
+  }
+}
+
+static void accept_incoming(reactor_t *r) {
+  uint64_t count;
+  read(r->wakeup_fd, &count, sizeof(count)); // Reset the eventfd
+
+  while (1) {
+    pthread_mutex_lock(&r->incoming_mutex);
+    if (is_empty(r->incoming)) {
+      pthread_mutex_unlock(&r->incoming_mutex);
+      break;
+    }
+    int client_socket = dequeue(r->incoming);
+    pthread_mutex_unlock(&r->incoming_mutex);
+    spawn(r, client_socket);
+  }
+}
+
+static void expire_timers(reactor_t *r) {
+  uint64_t now = now_ms();
+  while (r->timer_count > 0 && r->timers[0]->deadline <= now) {
+    coro_t *coro = r->timers[0];
+    timer_remove(r, coro);
+    if (coro->wait_fd != -1) {
+      // Disarm so a late event can't resume it a second time
+      epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, coro->wait_fd, NULL);
+      coro->timed_out = 1;
+    }
+    resume(r, coro);
+  }
+}
+
+static void *reactor_thread(void *arg) {
+  reactor_t *r = (reactor_t *)arg;
+  struct epoll_event events[CORO_MAX_EVENTS];
+
+  while (!stop) {
+    // Wake for the nearest timer, at least once a second to check stop
+    int timeout = 1000;
+    if (r->timer_count > 0) {
+      uint64_t now = now_ms();
+      uint64_t deadline = r->timers[0]->deadline;
+      timeout = deadline <= now ? 0 : (int)(deadline - now);
+      if (timeout > 1000)
+        timeout = 1000;
+    }
+
+    int n = epoll_wait(r->epoll_fd, events, CORO_MAX_EVENTS, timeout);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait failed");
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL) {
+        accept_incoming(r);
+        continue;
+      }
+      coro_t *coro = events[i].data.ptr;
+      timer_remove(r, coro);
+      resume(r, coro);
+    }
+    expire_timers(r);
+  }
+  return NULL;
+}
+
+// Start thread_count reactors, each running handler as a coroutine per socket
+int coro_start(int thread_count, coro_handler_t handler) {
+  page_size = sysconf(_SC_PAGESIZE);
+  coro_handler = handler;
+  reactors = calloc(thread_count, sizeof(reactor_t));
+  if (reactors == NULL) {
+    return -1;
+  }
+
+  for (int i = 0; i < thread_count; i++) {
+    reactor_t *r = &reactors[i];
+    r->incoming = create_queue();
+    pthread_mutex_init(&r->incoming_mutex, NULL);
+    r->epoll_fd = epoll_create1(0);
+    r->wakeup_fd = eventfd(0, EFD_NONBLOCK);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (r->epoll_fd < 0 || r->wakeup_fd < 0 ||
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wakeup_fd, &ev) != 0 ||
+        pthread_create(&r->thread, NULL, reactor_thread, r) != 0) {
+      perror("Failed to start reactor");
+      reactor_count = i;
+      coro_stop();
+      return -1;
+    }
+    reactor_count = i + 1;
+  }
+  return 0;
+}
+
+// Hand a socket to a reactor, it is made non-blocking for the coroutine
+void coro_spawn(int client_socket) {
+  reactor_t *r = &reactors[__atomic_fetch_add(&next_reactor, 1,
+                                              __ATOMIC_RELAXED) %
+                           reactor_count];
+  int flags = fcntl(client_socket, F_GETFL, 0);
+  fcntl(client_socket, F_SETFL, flags | O_NONBLOCK);
+
+  pthread_mutex_lock(&r->incoming_mutex);
+  enqueue(r->incoming, client_socket);
+  pthread_mutex_unlock(&r->incoming_mutex);
+
+  uint64_t one = 1;
+  write(r->wakeup_fd, &one, sizeof(one));
+}
+
+// Stop the reactors. Coroutines still waiting are abandoned with their stacks
+void coro_stop() {
+  stop = 1;
+  for (int i = 0; i < reactor_count; i++) {
+    uint64_t one = 1;
+    write(reactors[i].wakeup_fd, &one, sizeof(one));
+    pthread_join(reactors[i].thread, NULL);
+  }
+  for (int i = 0; i < reactor_count; i++) {
+    reactor_t *r = &reactors[i];
+    if (r->coro_count > 0) {
+      printf("Reactor %d dropped %d coroutines\n", i, r->coro_count);
+    }
+    while (r->free_stack_count > 0) {
+      munmap(r->free_stacks[--r->free_stack_count], CORO_STACK_SIZE + page_size);
+    }
+    free(r->timers);
+    close(r->epoll_fd);
+    close(r->wakeup_fd);
+    pthread_mutex_destroy(&r->incoming_mutex);
+    free_queue(r->incoming);
+  }
+  free(reactors);
+  reactors = NULL;
+  reactor_count = 0;
+}
@@ -0,0 +1,24 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <sys/epoll.h>
+
+#define CORO_REACTOR_THREADS 2
+#define CORO_STACK_SIZE (64 * 1024) // Per coroutine, plus one guard page
+#define CORO_STACK_POOL 1024        // Free stacks kept for reuse per reactor
+#define CORO_MAX_EVENTS 256
+#define CORO_IO_TIMEOUT_MS 30000 // Longest a handler waits on a quiet socket
+
+// Handler run as a coroutine for every spawned client socket
+typedef void (*coro_handler_t)(int client_socket);
+
+int coro_start(int thread_count, coro_handler_t handler);
+void coro_spawn(int client_socket);
+void coro_stop();
+
+// Only valid inside a coroutine, these yield to the reactor until woken
+int coro_active();
+int coro_await_fd(int fd, int events, int timeout_ms);
+void coro_sleep(int timeout_ms);
+
+#endif
@@ -7,6 +7,8 @@
 
 #define PORT 8080
 #define BUFFER_SIZE 1024
+#define MAX_REQUEST_SIZE (1024 * 1024) // Larger requests get 413
+#define MAX_CONNECTIONS 65536 // Highest client socket fd tracked per connection
 
 void handle_client(int client_socket);
 
@@ -0,0 +1,73 @@
+#define _GNU_SOURCE
+#include "numa.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Parse a sysfs list such as "0-11,24-35" into a cpu set, returns the count
+static int parse_cpulist(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *curr = list;
+    while (*curr != '\0' && *curr != '\n') {
+        char *end;
+        long first = strtol(curr, &end, 10);
+        if (end == curr) {
+            return -1;
+        }
+        long last = first;
+        if (*end == '-') {
+            curr = end + 1;
+            last = strtol(curr, &end, 10);
+            if (end == curr) {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        curr = (*end == ',') ? end + 1 : end;
+    }
+    return CPU_COUNT(set);
+}
+
+static int read_line(const char *path, char *buffer, size_t size) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char *line = fgets(buffer, size, file);
+    fclose(file);
+    return line == NULL ? -1 : 0;
+}
+
+// Read the NUMA topology from sysfs. Returns the number of nodes with CPUs,
+// or 0 when the topology is not available (non-NUMA kernel, no sysfs)
+int numa_detect(numa_node_t *nodes, int max_nodes) {
+    char line[1024];
+    cpu_set_t online;
+    if (read_line(NUMA_SYSFS_PATH "/online", line, sizeof(line)) != 0 ||
+        parse_cpulist(line, &online) <= 0) { // Node ids use the same format
+        return 0;
+    }
+
+    int count = 0;
+    for (int id = 0; id < CPU_SETSIZE && count < max_nodes; id++) {
+        if (!CPU_ISSET(id, &online)) {
+            continue;
+        }
+        char path[64];
+        snprintf(path, sizeof(path), NUMA_SYSFS_PATH "/node%d/cpulist", id);
+        if (read_line(path, line, sizeof(line)) != 0) {
+            continue;
+        }
+        // Skip memory-only nodes, no worker can run there
+        int cpu_count = parse_cpulist(line, &nodes[count].cpus);
+        if (cpu_count <= 0) {
+            continue;
+        }
+        nodes[count].id = id;
+        nodes[count].cpu_count = cpu_count;
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,17 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <sched.h> // cpu_set_t, needs _GNU_SOURCE defined by the includer
+
+#define MAX_NUMA_NODES 16
+#define NUMA_SYSFS_PATH "/sys/devices/system/node"
+
+typedef struct {
+    int id;          // Node number as listed in sysfs
+    cpu_set_t cpus;  // CPUs local to this node
+    int cpu_count;
+} numa_node_t;
+
+int numa_detect(numa_node_t *nodes, int max_nodes);
+
+#endif
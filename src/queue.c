@@ -1,5 +1,12 @@
 #include "queue.h"
 #include <stdio.h>
+#include <time.h>
+
+uint64_t queue_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
 task_queue_t* create_queue() {
     task_queue_t *queue = (task_queue_t*)malloc(sizeof(task_queue_t));
@@ -18,6 +25,7 @@ void enqueue(task_queue_t *queue, int value) {
         exit(1);
     }
     new_node->client_socket = value;
+    new_node->enqueued_ns = queue_now_ns();
     new_node->next = NULL;
 
     if (is_empty(queue)) {
@@ -29,12 +37,20 @@ void enqueue(task_queue_t *queue, int value) {
 }
 
 int dequeue(task_queue_t *queue) {
+    return dequeue_timed(queue, NULL);
+}
+
+// Dequeue and report when the task was queued, for queue wait times
+int dequeue_timed(task_queue_t *queue, uint64_t *enqueued_ns) {
     if (is_empty(queue)) {
         fprintf(stderr, "Queue is empty\n");
         exit(1);
     }
     task_node_t *temp = queue->front;
     int value = temp->client_socket;
+    if (enqueued_ns != NULL) {
+        *enqueued_ns = temp->enqueued_ns;
+    }
     queue->front = queue->front->next;
     free(temp);
 
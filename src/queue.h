@@ -1,6 +1,7 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
+#include <stdint.h>
 #include <stdlib.h>
 
 typedef struct task_node task_node_t;
@@ -9,12 +10,15 @@ typedef struct task_queue task_queue_t;
 task_queue_t* create_queue();
 void enqueue(task_queue_t *queue, int value);
 int dequeue(task_queue_t *queue);
+int dequeue_timed(task_queue_t *queue, uint64_t *enqueued_ns);
+uint64_t queue_now_ns();
 int is_empty(task_queue_t *queue);
 void print_queue(task_queue_t *queue);
 void free_queue(task_queue_t *queue);
 
 struct task_node {
     int client_socket;
+    uint64_t enqueued_ns; // Monotonic time the task was queued
     struct task_node *next;
 };
 
@@ -0,0 +1,629 @@
+#include "replication.h"
+#include "http_server.h"
+#include "request_handler.h"
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Each frame is a fixed header followed by the path and the data:
+// type (1), seq (8), timestamp ms (8), path length (4), data length (4)
+#define FRAME_HEADER_SIZE 25
+
+// Values aren't copied into the log, senders read the endpoint's current
+// value when they ship a set. Replaying a newer value early is safe for the
+// same reason snapshots are, and keeps the log a fixed size however large
+// the bodies are
+typedef struct {
+  uint64_t seq;
+  uint64_t timestamp_ms; // Leader wall clock when the mutation was applied
+  int op;                // STORE_SET or STORE_DELETE
+  char path[MAX_PATH_LENGTH];
+} log_entry_t;
+
+typedef struct {
+  int type;
+  uint64_t seq;
+  uint64_t timestamp_ms;
+  uint32_t path_length;
+  uint32_t data_length;
+} frame_t;
+
+static volatile int stop = 0;
+static pthread_t replication_thread; // Listener on the leader, receiver on a follower
+
+// Leader: ordered mutation log, seq n lives in slot n % REPLICATION_LOG_SIZE
+static int leader = 0;
+static log_entry_t mutation_log[REPLICATION_LOG_SIZE];
+static uint64_t head_seq = 0; // Last logged mutation
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static int listen_fd = -1;
+static int follower_sockets[REPLICATION_MAX_FOLLOWERS]; // Guarded by log_mutex
+static int follower_count = 0;
+
+// Follower: where it is in the leader's log
+static int follower = 0;
+static char leader_host[256];
+static int leader_port;
+static int leader_fd = -1;
+static int connected = 0;
+static uint64_t applied_seq = 0;
+static uint64_t leader_seq = 0;  // Leader head as last reported
+static uint64_t pending_ms = 0;  // Commit time of the oldest unapplied mutation
+static pthread_mutex_t follower_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Snapshot being received, only swapped into the store once it is complete
+// so a resync never serves an empty or partial store. Follower thread only
+typedef struct staged_entry {
+  char path[MAX_PATH_LENGTH];
+  char *data;
+  size_t length;
+  struct staged_entry *next;
+} staged_entry_t;
+
+static staged_entry_t *staged = NULL;
+
+static uint64_t wall_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t monotonic_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Wire format
+
+static int send_all(int fd, const void *buf, size_t len, int flags) {
+  const char *curr = buf;
+  while (len > 0) {
+    ssize_t sent = send(fd, curr, len, flags | MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    curr += sent;
+    len -= sent;
+  }
+  return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t len) {
+  char *curr = buf;
+  while (len > 0) {
+    ssize_t received = recv(fd, curr, len, 0);
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received <= 0)
+      return -1;
+    curr += received;
+    len -= received;
+  }
+  return 0;
+}
+
+static int send_frame(int fd, int type, uint64_t seq, uint64_t timestamp_ms,
+                      const char *path, const char *data, size_t length) {
+  unsigned char header[FRAME_HEADER_SIZE];
+  size_t path_length = path != NULL ? strlen(path) : 0;
+  uint64_t value64;
+  uint32_t value32;
+
+  header[0] = type;
+  value64 = htobe64(seq);
+  memcpy(header + 1, &value64, 8);
+  value64 = htobe64(timestamp_ms);
+  memcpy(header + 9, &value64, 8);
+  value32 = htonl(path_length);
+  memcpy(header + 17, &value32, 4);
+  value32 = htonl(length);
+  memcpy(header + 21, &value32, 4);
+
+  // MSG_MORE keeps the pieces of a frame in one segment
+  return send_all(fd, header, sizeof(header), length ? MSG_MORE : 0) ||
+         send_all(fd, path, path_length, length ? MSG_MORE : 0) ||
+         send_all(fd, data, length, 0);
+}
+
+// On success data holds a heap copy (or NULL) the caller frees
+static int recv_frame(int fd, frame_t *frame, char *path, char **data) {
+  unsigned char header[FRAME_HEADER_SIZE];
+  uint64_t value64;
+  uint32_t value32;
+
+  *data = NULL;
+  if (recv_all(fd, header, sizeof(header)) != 0) {
+    return -1;
+  }
+  frame->type = header[0];
+  memcpy(&value64, header + 1, 8);
+  frame->seq = be64toh(value64);
+  memcpy(&value64, header + 9, 8);
+  frame->timestamp_ms = be64toh(value64);
+  memcpy(&value32, header + 17, 4);
+  frame->path_length = ntohl(value32);
+  memcpy(&value32, header + 21, 4);
+  frame->data_length = ntohl(value32);
+
+  if (frame->path_length >= MAX_PATH_LENGTH ||
+      frame->data_length > MAX_REQUEST_SIZE) {
+    fprintf(stderr, "Malformed replication frame\n");
+    return -1;
+  }
+  if (recv_all(fd, path, frame->path_length) != 0) {
+    return -1;
+  }
+  path[frame->path_length] = '\0';
+
+  if (frame->data_length > 0) {
+    *data = malloc(frame->data_length);
+    if (*data == NULL || recv_all(fd, *data, frame->data_length) != 0) {
+      free(*data);
+      *data = NULL;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Leader
+
+// mutation_hook_t, runs under the endpoint's mutex so the log order matches
+// the order each endpoint's mutations were applied in
+static void log_mutation(int op, const char *path) {
+  pthread_mutex_lock(&log_mutex);
+  head_seq++;
+  log_entry_t *entry = &mutation_log[head_seq % REPLICATION_LOG_SIZE];
+  entry->seq = head_seq;
+  entry->timestamp_ms = wall_ms();
+  entry->op = op;
+  strncpy(entry->path, path, MAX_PATH_LENGTH - 1);
+  entry->path[MAX_PATH_LENGTH - 1] = '\0';
+  pthread_cond_broadcast(&log_cond);
+  pthread_mutex_unlock(&log_mutex);
+}
+
+// Send every endpoint, then the seq the follower should tail from. Entries
+// logged while copying are replayed on top, which is safe as a set or delete
+// overwrites the whole value and each endpoint's order is preserved
+static int send_snapshot(int fd, uint64_t *next_seq) {
+  pthread_mutex_lock(&log_mutex);
+  uint64_t start = head_seq;
+  pthread_mutex_unlock(&log_mutex);
+
+  uint64_t now = wall_ms();
+  if (send_frame(fd, REPL_SNAPSHOT_BEGIN, start, now, NULL, NULL, 0) != 0) {
+    return -1;
+  }
+  int count = get_endpoint_count();
+  for (int i = 0; i < count; i++) {
+    char *data = get_endpoint_data(i);
+    if (data == NULL) {
+      continue;
+    }
+    int rc = send_frame(fd, REPL_SNAPSHOT_ENTRY, start, now,
+                        get_endpoint_path(i), data, strlen(data));
+    free(data);
+    if (rc != 0) {
+      return -1;
+    }
+  }
+  if (send_frame(fd, REPL_SNAPSHOT_END, start, now, NULL, NULL, 0) != 0) {
+    return -1;
+  }
+  *next_seq = start + 1;
+  return 0;
+}
+
+// Streams the log to one follower. Heartbeats carry the leader's head and
+// the commit time of the oldest mutation this follower hasn't been sent
+static void *sender_thread(void *arg) {
+  int fd = (int)(intptr_t)arg;
+  uint64_t next_seq = 0;
+  uint64_t last_heartbeat = monotonic_ms();
+  int ok = send_snapshot(fd, &next_seq) == 0;
+
+  while (ok && !stop) {
+    pthread_mutex_lock(&log_mutex);
+    if (next_seq > head_seq) { // Caught up, wait for a mutation
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += REPLICATION_HEARTBEAT_MS / 1000;
+      deadline.tv_nsec += (REPLICATION_HEARTBEAT_MS % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      while (next_seq > head_seq && !stop &&
+             pthread_cond_timedwait(&log_cond, &log_mutex, &deadline) == 0)
+        ;
+    }
+    if (stop) {
+      pthread_mutex_unlock(&log_mutex);
+      break;
+    }
+
+    uint64_t head = head_seq;
+    if (next_seq <= head && head - next_seq >= REPLICATION_LOG_SIZE) {
+      pthread_mutex_unlock(&log_mutex);
+      fprintf(stderr, "Follower fell behind the log, sending a snapshot\n");
+      ok = send_snapshot(fd, &next_seq) == 0;
+      continue;
+    }
+
+    log_entry_t entry = {0};
+    if (next_seq <= head) {
+      entry = mutation_log[next_seq % REPLICATION_LOG_SIZE];
+    }
+    pthread_mutex_unlock(&log_mutex);
+
+    uint64_t now = monotonic_ms();
+    if (next_seq > head || now - last_heartbeat >= REPLICATION_HEARTBEAT_MS) {
+      uint64_t pending = next_seq <= head ? entry.timestamp_ms : wall_ms();
+      ok = send_frame(fd, REPL_HEARTBEAT, head, pending, NULL, NULL, 0) == 0;
+      last_heartbeat = now;
+    }
+    if (!ok || next_seq > head) {
+      continue;
+    }
+
+    // A value deleted since it was set goes out as the delete
+    char *data = NULL;
+    if (entry.op == STORE_SET) {
+      int index = find_endpoint(entry.path);
+      data = index != -1 ? get_endpoint_data(index) : NULL;
+    }
+    ok = send_frame(fd, data != NULL ? REPL_SET : REPL_DELETE, entry.seq,
+                    entry.timestamp_ms, entry.path, data,
+                    data != NULL ? strlen(data) : 0) == 0;
+    free(data);
+    next_seq++;
+  }
+
+  pthread_mutex_lock(&log_mutex);
+  for (int i = 0; i < follower_count; i++) {
+    if (follower_sockets[i] == fd) {
+      follower_sockets[i] = follower_sockets[--follower_count];
+      break;
+    }
+  }
+  pthread_cond_broadcast(&log_cond); // replication_stop waits for the count
+  pthread_mutex_unlock(&log_mutex);
+  close(fd);
+  printf("Follower disconnected\n");
+  return NULL;
+}
+
+static void *listener_thread(void *arg) {
+  while (!stop) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (!stop && errno != EINTR) {
+        perror("Replication accept failed");
+      }
+      continue;
+    }
+
+    pthread_mutex_lock(&log_mutex);
+    if (follower_count == REPLICATION_MAX_FOLLOWERS) {
+      pthread_mutex_unlock(&log_mutex);
+      fprintf(stderr, "Too many followers\n");
+      close(fd);
+      continue;
+    }
+    follower_sockets[follower_count++] = fd;
+    pthread_mutex_unlock(&log_mutex);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sender_thread, (void *)(intptr_t)fd) !=
+        0) {
+      pthread_mutex_lock(&log_mutex);
+      follower_sockets[--follower_count] = -1;
+      pthread_mutex_unlock(&log_mutex);
+      close(fd);
+      continue;
+    }
+    pthread_detach(thread);
+    printf("Follower connected\n");
+  }
+  return NULL;
+}
+
+// Accept followers on 127.0.0.1:port and log every store mutation for them
+int replication_start_leader(int port) {
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    perror("Replication socket failed");
+    return -1;
+  }
+  int opt = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+  struct sockaddr_in address = {0};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = inet_addr("127.0.0.1");
+  address.sin_port = htons(port);
+  if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(listen_fd, REPLICATION_MAX_FOLLOWERS) < 0) {
+    perror("Replication bind failed");
+    close(listen_fd);
+    listen_fd = -1;
+    return -1;
+  }
+
+  leader = 1;
+  set_mutation_hook(log_mutation);
+  if (pthread_create(&replication_thread, NULL, listener_thread, NULL) != 0) {
+    set_mutation_hook(NULL);
+    leader = 0;
+    close(listen_fd);
+    listen_fd = -1;
+    return -1;
+  }
+  printf("Replication leader listening on localhost:%d\n", port);
+  return 0;
+}
+
+// Follower
+
+static int connect_to_leader() {
+  struct addrinfo hints = {0}, *result;
+  char port[16];
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(port, sizeof(port), "%d", leader_port);
+  if (getaddrinfo(leader_host, port, &hints, &result) != 0) {
+    return -1;
+  }
+  int fd = socket(result->ai_family, result->ai_socktype, 0);
+  if (fd >= 0 && connect(fd, result->ai_addr, result->ai_addrlen) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(result);
+  return fd;
+}
+
+// Returns -1 if the mutation couldn't be applied. The store has diverged
+// then, so the caller drops the connection and resyncs from a snapshot
+static void free_staged() {
+  while (staged != NULL) {
+    staged_entry_t *next = staged->next;
+    free(staged->data);
+    free(staged);
+    staged = next;
+  }
+}
+
+// Deletes the endpoints the snapshot doesn't have, then stores its entries
+static int apply_snapshot() {
+  int rc = 0;
+  for (int i = 0; i < get_endpoint_count(); i++) {
+    const char *endpoint_path = get_endpoint_path(i);
+    staged_entry_t *entry = staged;
+    while (entry != NULL && strcmp(entry->path, endpoint_path) != 0) {
+      entry = entry->next;
+    }
+    if (entry == NULL) {
+      delete_endpoint_data(i);
+    }
+  }
+  for (staged_entry_t *entry = staged; entry != NULL && rc == 0;
+       entry = entry->next) {
+    int index = find_or_reuse_endpoint(entry->path);
+    if (index == -1) {
+      fprintf(stderr, "Error: No space for replicated endpoint %s\n",
+              entry->path);
+      rc = -1;
+    } else {
+      rc = store_endpoint_data(index, entry->data ? entry->data : "",
+                               entry->length);
+    }
+  }
+  free_staged();
+  return rc;
+}
+
+// Snapshot entries take ownership of *data
+static int apply_frame(const frame_t *frame, const char *path, char **data) {
+  int index, rc = 0;
+  staged_entry_t *entry;
+  switch (frame->type) {
+  case REPL_SNAPSHOT_BEGIN:
+    free_staged(); // Left over from a connection lost mid-snapshot
+    break;
+  case REPL_SNAPSHOT_ENTRY:
+    entry = malloc(sizeof(staged_entry_t));
+    if (entry == NULL) {
+      rc = -1;
+      break;
+    }
+    strcpy(entry->path, path);
+    entry->data = *data;
+    entry->length = frame->data_length;
+    entry->next = staged;
+    staged = entry;
+    *data = NULL;
+    break;
+  case REPL_SNAPSHOT_END:
+    rc = apply_snapshot();
+    break;
+  case REPL_DELETE:
+    index = find_endpoint(path); // Nothing to delete if it was never stored
+    if (index != -1) {
+      delete_endpoint_data(index);
+    }
+    break;
+  case REPL_SET:
+    index = find_or_reuse_endpoint(path);
+    if (index == -1) {
+      fprintf(stderr, "Error: No space for replicated endpoint %s\n", path);
+      rc = -1;
+    } else {
+      rc = store_endpoint_data(index, *data ? *data : "", frame->data_length);
+    }
+    break;
+  }
+
+  pthread_mutex_lock(&follower_mutex);
+  if (frame->seq > leader_seq || frame->type == REPL_SNAPSHOT_BEGIN) {
+    leader_seq = frame->seq; // A new snapshot may come from a restarted leader
+  }
+  if (rc != 0) {
+    pthread_mutex_unlock(&follower_mutex); // applied_seq stays behind
+    return -1;
+  }
+  switch (frame->type) {
+  case REPL_SNAPSHOT_BEGIN:
+    applied_seq = 0; // Behind until the snapshot is loaded
+    pending_ms = frame->timestamp_ms;
+    break;
+  case REPL_SNAPSHOT_END:
+    applied_seq = frame->seq;
+    pending_ms = wall_ms();
+    break;
+  case REPL_SET:
+  case REPL_DELETE:
+    applied_seq = frame->seq;
+    pending_ms = frame->timestamp_ms; // The next one committed no earlier
+    break;
+  case REPL_HEARTBEAT:
+    pending_ms = frame->timestamp_ms;
+    break;
+  }
+  pthread_mutex_unlock(&follower_mutex);
+  return 0;
+}
+
+static void *follower_thread(void *arg) {
+  char path[MAX_PATH_LENGTH];
+  while (!stop) {
+    int fd = connect_to_leader();
+    if (fd < 0) {
+      sleep(REPLICATION_RETRY_SECONDS);
+      continue;
+    }
+    pthread_mutex_lock(&follower_mutex);
+    leader_fd = fd;
+    connected = 1;
+    pthread_mutex_unlock(&follower_mutex);
+    printf("Following leader %s:%d\n", leader_host, leader_port);
+
+    frame_t frame;
+    char *data;
+    while (!stop && recv_frame(fd, &frame, path, &data) == 0) {
+      int rc = apply_frame(&frame, path, &data);
+      free(data);
+      if (rc != 0) {
+        fprintf(stderr, "Failed to apply seq %llu, resyncing\n",
+                (unsigned long long)frame.seq);
+        break;
+      }
+    }
+
+    pthread_mutex_lock(&follower_mutex);
+    leader_fd = -1;
+    connected = 0;
+    pthread_mutex_unlock(&follower_mutex);
+    close(fd);
+    free_staged();
+    if (!stop) {
+      fprintf(stderr, "Lost leader, reconnecting\n");
+      sleep(REPLICATION_RETRY_SECONDS);
+    }
+  }
+  return NULL;
+}
+
+// Bootstrap from the leader's snapshot, then tail its log. Writes from
+// clients are refused while following
+int replication_start_follower(const char *host, int port) {
+  strncpy(leader_host, host, sizeof(leader_host) - 1);
+  leader_port = port;
+  follower = 1;
+  if (pthread_create(&replication_thread, NULL, follower_thread, NULL) != 0) {
+    follower = 0;
+    return -1;
+  }
+  return 0;
+}
+
+int replication_is_follower() { return follower; }
+
+void replication_stop() {
+  if (!leader && !follower) {
+    return;
+  }
+  stop = 1;
+
+  if (leader) {
+    set_mutation_hook(NULL);
+    shutdown(listen_fd, SHUT_RDWR); // Unblocks accept()
+    pthread_join(replication_thread, NULL);
+    close(listen_fd);
+
+    // Wake the senders and wait for them to let go of the log
+    pthread_mutex_lock(&log_mutex);
+    for (int i = 0; i < follower_count; i++) {
+      shutdown(follower_sockets[i], SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&log_cond);
+    while (follower_count > 0) {
+      pthread_cond_wait(&log_cond, &log_mutex);
+    }
+    pthread_mutex_unlock(&log_mutex);
+  } else {
+    pthread_mutex_lock(&follower_mutex);
+    if (leader_fd >= 0) {
+      shutdown(leader_fd, SHUT_RDWR); // Unblocks recv()
+    }
+    pthread_mutex_unlock(&follower_mutex);
+    pthread_join(replication_thread, NULL);
+  }
+  leader = follower = 0;
+}
+
+// Prometheus text format
+int replication_metrics(char *buffer, size_t size) {
+  if (follower) {
+    pthread_mutex_lock(&follower_mutex);
+    double lag = 0;
+    uint64_t now = wall_ms();
+    if (applied_seq < leader_seq && now > pending_ms) {
+      lag = (now - pending_ms) / 1000.0;
+    }
+    int length = snprintf(
+        buffer, size,
+        "replication_role{role=\"follower\"} 1\n"
+        "replication_connected %d\n"
+        "replication_applied_seq %llu\n"
+        "replication_leader_seq %llu\n"
+        "replication_lag_entries %llu\n"
+        "replication_lag_seconds %.3f\n",
+        connected, (unsigned long long)applied_seq,
+        (unsigned long long)leader_seq,
+        (unsigned long long)(leader_seq - applied_seq), lag);
+    pthread_mutex_unlock(&follower_mutex);
+    return length;
+  }
+  if (leader) {
+    pthread_mutex_lock(&log_mutex);
+    int length = snprintf(buffer, size,
+                          "replication_role{role=\"leader\"} 1\n"
+                          "replication_head_seq %llu\n"
+                          "replication_followers %d\n",
+                          (unsigned long long)head_seq, follower_count);
+    pthread_mutex_unlock(&log_mutex);
+    return length;
+  }
+  return snprintf(buffer, size, "replication_role{role=\"standalone\"} 1\n");
+}
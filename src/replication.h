@@ -0,0 +1,26 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stddef.h>
+
+#define REPLICATION_LOG_SIZE 4096    // Mutations kept for followers to tail
+#define REPLICATION_MAX_FOLLOWERS 16
+#define REPLICATION_HEARTBEAT_MS 1000 // Leader idle interval between heartbeats
+#define REPLICATION_RETRY_SECONDS 1   // Follower reconnect delay
+#define METRICS_PATH "/metrics"
+
+// Frame types on the replication stream
+#define REPL_SNAPSHOT_BEGIN 1
+#define REPL_SNAPSHOT_ENTRY 2
+#define REPL_SNAPSHOT_END 3
+#define REPL_SET 4
+#define REPL_DELETE 5
+#define REPL_HEARTBEAT 6
+
+int replication_start_leader(int port);
+int replication_start_follower(const char *host, int port);
+void replication_stop();
+int replication_is_follower();
+int replication_metrics(char *buffer, size_t size);
+
+#endif
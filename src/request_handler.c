@@ -1,9 +1,11 @@
 #include "request_handler.h"
+#include <strings.h>
 
 Endpoint endpoints[MAX_ENDPOINTS]; // Array of endpoints
 int endpoint_count = 0;
 pthread_mutex_t endpoints_mutex =
     PTHREAD_MUTEX_INITIALIZER; // Mutex for endpoints
+static mutation_hook_t mutation_hook = NULL; // e.g. the replication log
 
 static const struct content_type CONTENT_TYPES[] = {
     {".txt", "text/plain"},
@@ -25,6 +27,21 @@ static const struct content_type CONTENT_TYPES[] = {
     {NULL, "application/octet-stream"} // Default type
 };
 
+// Index of the endpoint with the given path, -1 if there is none. Unlike
+// find_or_create_endpoint() never takes one of the MAX_ENDPOINTS slots
+int find_endpoint(const char *path) {
+  pthread_mutex_lock(&endpoints_mutex);
+  int index = -1;
+  for (int i = 0; i < endpoint_count; i++) {
+    if (strcmp(endpoints[i].path, path) == 0) {
+      index = i;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&endpoints_mutex);
+  return index;
+}
+
 int find_or_create_endpoint(const char *path) {
   pthread_mutex_lock(&endpoints_mutex);
 
@@ -51,6 +68,29 @@ int find_or_create_endpoint(const char *path) {
   return index;
 }
 
+// Like find_or_create_endpoint(), but once every slot is taken the path
+// takes over a slot whose data was deleted. Only for a store with a single
+// writer, such as a follower applying its leader's log, and readers must
+// look paths up with find_endpoint_data() to not race the rename
+int find_or_reuse_endpoint(const char *path) {
+  int index = find_or_create_endpoint(path);
+  if (index != -1) {
+    return index;
+  }
+  pthread_mutex_lock(&endpoints_mutex);
+  for (int i = 0; i < endpoint_count && index == -1; i++) {
+    pthread_mutex_lock(&endpoints[i].mutex);
+    if (endpoints[i].data == NULL) {
+      strncpy(endpoints[i].path, path, MAX_PATH_LENGTH - 1);
+      endpoints[i].path[MAX_PATH_LENGTH - 1] = '\0';
+      index = i;
+    }
+    pthread_mutex_unlock(&endpoints[i].mutex);
+  }
+  pthread_mutex_unlock(&endpoints_mutex);
+  return index;
+}
+
 const char *get_status_message(int status_code) {
   switch (status_code) {
   case 200:
@@ -59,10 +99,14 @@ const char *get_status_message(int status_code) {
     return "No Content";
   case 400:
     return "Bad Request";
+  case 403:
+    return "Forbidden";
   case 404:
     return "Not Found";
   case 412:
     return "Precondition Failed: Content-Type and Content-Length required";
+  case 413:
+    return "Payload Too Large";
   case 415:
     return "Unsupported Media Type";
   case 500:
@@ -72,38 +116,223 @@ const char *get_status_message(int status_code) {
   }
 }
 
-HttpRequest body_parser(const char *curr, HttpRequest req, int index) {
+// Replace the data stored at an endpoint with a copy of data. Returns -1 if
+// the copy couldn't be allocated, the endpoint is left empty
+int store_endpoint_data(int index, const char *data, size_t length) {
+  int rc = 0;
+  pthread_mutex_lock(&endpoints[index].mutex);
+
+  // Free previous data if it exists
+  if (endpoints[index].data != NULL) {
+    free(endpoints[index].data);
+  }
+
+  // Allocate memory for the new data
+  endpoints[index].data = malloc(length + 1);
+  if (endpoints[index].data == NULL) {
+    fprintf(stderr, "Failed to allocate memory for endpoint data\n");
+    rc = -1;
+    if (mutation_hook != NULL) { // The old data is gone either way
+      mutation_hook(STORE_DELETE, endpoints[index].path);
+    }
+  } else {
+    memcpy(endpoints[index].data, data, length);
+    endpoints[index].data[length] = '\0'; // Null-terminate the string
+    if (mutation_hook != NULL) {
+      mutation_hook(STORE_SET, endpoints[index].path);
+    }
+  }
+
+  pthread_mutex_unlock(&endpoints[index].mutex);
+  return rc;
+}
+
+// Remove the data stored at an endpoint, returns 0 if there was none
+int delete_endpoint_data(int index) {
+  int deleted = 0;
+  pthread_mutex_lock(&endpoints[index].mutex);
+  if (endpoints[index].data != NULL) {
+    free(endpoints[index].data);
+    endpoints[index].data = NULL;
+    deleted = 1;
+    if (mutation_hook != NULL) {
+      mutation_hook(STORE_DELETE, endpoints[index].path);
+    }
+  }
+  pthread_mutex_unlock(&endpoints[index].mutex);
+  return deleted;
+}
+
+int get_endpoint_count() {
+  pthread_mutex_lock(&endpoints_mutex);
+  int count = endpoint_count;
+  pthread_mutex_unlock(&endpoints_mutex);
+  return count;
+}
+
+// Paths only change when find_or_reuse_endpoint() hands the slot over, on
+// the thread that called it
+const char *get_endpoint_path(int index) { return endpoints[index].path; }
+
+void set_mutation_hook(mutation_hook_t hook) { mutation_hook = hook; }
+
+// Store the body, content_length bytes of it when the request sent a
+// Content-Length (-1 otherwise, the body is the rest of the request)
+HttpRequest body_parser(const char *curr, HttpRequest req, int index,
+                        long content_length) {
   // Move past the empty line separating headers from body
   if (curr[0] == '\r' && curr[1] == '\n') {
     curr += 2;
   }
 
-  // Body is the rest of the request
-  if (*curr != '\0') {
+  size_t length = strlen(curr);
+  if (content_length >= 0) {
+    if (length < (size_t)content_length) {
+      req.response_code = 400; // Peer closed before sending the whole body
+      req.body = NULL;
+      return req;
+    }
+    length = content_length; // Anything past it isn't part of this body
+  }
+
+  if (length > 0) {
     req.body = curr;
-    size_t body_length = strlen(req.body);
+    store_endpoint_data(index, req.body, length);
+  } else {
+    req.body = NULL;
+  }
 
-    pthread_mutex_lock(&endpoints[index].mutex);
+  return req;
+}
 
-    // Free previous data if it exists
-    if (endpoints[index].data != NULL) {
-      free(endpoints[index].data);
+static const char *find_crlf(const char *curr, const char *end) {
+  for (; curr + 1 < end; curr++) {
+    if (curr[0] == '\r' && curr[1] == '\n') {
+      return curr;
     }
+  }
+  return NULL;
+}
 
-    // Allocate memory for the new data
-    endpoints[index].data = malloc(body_length + 1);
-    if (endpoints[index].data == NULL) {
-      fprintf(stderr, "Failed to allocate memory for endpoint data\n");
-    } else {
-      strncpy(endpoints[index].data, req.body, body_length);
-      endpoints[index].data[body_length] = '\0'; // Null-terminate the string
+// Decode a chunked transfer-encoded body of length bytes into dst, which
+// needs room for length bytes. dst may be NULL to only validate the framing.
+// Returns the decoded length, CHUNKED_INCOMPLETE if more input is needed or
+// CHUNKED_MALFORMED
+ssize_t decode_chunked(const char *src, size_t length, char *dst) {
+  const char *curr = src;
+  const char *end = src + length;
+  size_t decoded = 0;
+
+  while (1) {
+    // chunk-size [; extensions] CRLF
+    const char *line_end = find_crlf(curr, end);
+    if (line_end == NULL) {
+      return CHUNKED_INCOMPLETE;
     }
+    size_t chunk_size = 0;
+    int digits = 0;
+    for (; curr < line_end; curr++, digits++) {
+      int value;
+      if (*curr >= '0' && *curr <= '9')
+        value = *curr - '0';
+      else if (*curr >= 'a' && *curr <= 'f')
+        value = *curr - 'a' + 10;
+      else if (*curr >= 'A' && *curr <= 'F')
+        value = *curr - 'A' + 10;
+      else
+        break;
+      if (digits == 8) {
+        return CHUNKED_MALFORMED; // Larger than any request we accept
+      }
+      chunk_size = chunk_size * 16 + value;
+    }
+    if (digits == 0 || (curr < line_end && *curr != ';' && *curr != ' ' &&
+                        *curr != '\t')) {
+      return CHUNKED_MALFORMED;
+    }
+    curr = line_end + 2;
 
-    pthread_mutex_unlock(&endpoints[index].mutex);
-  } else {
-    req.body = NULL;
+    if (chunk_size == 0) {
+      // Skip any trailer fields up to the terminating empty line
+      while ((line_end = find_crlf(curr, end)) != curr) {
+        if (line_end == NULL) {
+          return CHUNKED_INCOMPLETE;
+        }
+        curr = line_end + 2;
+      }
+      return decoded;
+    }
+
+    if ((size_t)(end - curr) < chunk_size + 2) {
+      return CHUNKED_INCOMPLETE;
+    }
+    if (curr[chunk_size] != '\r' || curr[chunk_size + 1] != '\n') {
+      return CHUNKED_MALFORMED;
+    }
+    if (dst != NULL) {
+      memcpy(dst + decoded, curr, chunk_size);
+    }
+    decoded += chunk_size;
+    curr += chunk_size + 2;
+  }
+}
+
+// Check whether length bytes of request hold the headers and the whole body,
+// as framed by Content-Length or chunked encoding. Returns 1 when complete
+// (or malformed, parse_request reports it), 0 when more input is needed
+int request_complete(const char *request, size_t length) {
+  const char *header_end = strstr(request, "\r\n\r\n");
+  if (header_end == NULL) {
+    return 0;
+  }
+  const char *body = header_end + 4;
+  size_t body_length = length - (body - request);
+
+  size_t content_length = 0;
+  _Bool chunked = 0;
+  const char *line = strstr(request, "\r\n") + 2; // Skip the request line
+  while (line < header_end + 2) {
+    const char *line_end = strstr(line, "\r\n");
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      content_length = strtoul(line + 15, NULL, 10);
+    } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+      const char *value = line + 18;
+      while (*value == ' ')
+        value++;
+      // Whole value, the same exact match parse_request() makes
+      chunked = line_end - value == 7 && strncasecmp(value, "chunked", 7) == 0;
+    }
+    line = line_end + 2;
+  }
+
+  if (chunked) {
+    return decode_chunked(body, body_length, NULL) != CHUNKED_INCOMPLETE;
   }
+  return body_length >= content_length;
+}
 
+// Decode a chunked body and store it, curr points at the empty line that
+// ends the headers
+static HttpRequest chunked_body_parser(const char *curr, HttpRequest req,
+                                       int index) {
+  if (curr[0] == '\r' && curr[1] == '\n') {
+    curr += 2;
+  }
+  req.body = NULL; // Only the decoded copy holds the body
+
+  size_t length = strlen(curr);
+  char *decoded = malloc(length + 1);
+  if (decoded == NULL) {
+    req.response_code = 500;
+    return req;
+  }
+  ssize_t decoded_length = decode_chunked(curr, length, decoded);
+  if (decoded_length < 0) {
+    req.response_code = 400; // Bad or truncated chunk framing
+  } else if (decoded_length > 0) {
+    store_endpoint_data(index, decoded, decoded_length);
+  }
+  free(decoded);
   return req;
 }
 
@@ -116,47 +345,43 @@ HttpRequest parse_request(const char *request) {
 
   // Parse request line (e.g., "GET /path HTTP/1.1")
   end = strstr(curr, "\r\n"); // Gets the first occurence of "\r\n"
-  if (end) {
-    // When end is not NULL
-    sscanf(curr, "%9s %255s %9s", req.method, req.path,
-           req.version); // scan the request line and store the method and path
-    curr = end + 2;      // Move past \r\n
+  if (end == NULL) {
+    req.response_code = 400; // Unterminated request line
+    return req;
   }
+  sscanf(curr, "%9s %255s %9s", req.method, req.path,
+         req.version); // scan the request line and store the method and path
+  curr = end + 2;      // Move past \r\n
 
-  int index = find_or_create_endpoint(req.path);
+  _Bool requireBody = strcmp(req.method, "POST") == 0 ||
+                      strcmp(req.method, "PUT") == 0 ||
+                      strcmp(req.method, "PATCH") == 0;
 
-  if (index == -1) {
+  // Only writes create endpoints, so reads of unknown paths can't fill the
+  // MAX_ENDPOINTS slots
+  int index = requireBody ? find_or_create_endpoint(req.path)
+                          : find_endpoint(req.path);
+  if (requireBody && index == -1) {
     printf("Error: No space for new endpoint\n");
     req.response_code = 500;
     return req;
   }
 
-  if (strcmp(req.method, "DELETE") == 0) {
-    pthread_mutex_lock(&endpoints[index].mutex);
-    if (endpoints[index].data != NULL) {
-      free(endpoints[index].data);
-      endpoints[index].data = NULL;
-      req.response_code = 204;
-    } else {
-      req.response_code = 404;
-    }
-    pthread_mutex_unlock(&endpoints[index].mutex);
-  }
-
-  _Bool requireBody = strcmp(req.method, "POST") == 0 ||
-                      strcmp(req.method, "PUT") == 0 ||
-                      strcmp(req.method, "PATCH") == 0;
-
   // Parse headers
   req.header_count = 0;
   while (curr[0] != '\r' ||
          curr[1] != '\n') {     // Exit on empty line (i.e., \r\n\r\n)
     end = strstr(curr, "\r\n"); // End of current header
-    if (!end || req.header_count >= MAX_HEADERS)
-      break; // max headers reached
+    if (!end) {
+      // Header block never terminated, whatever follows is not a body
+      req.response_code = 400;
+      return req;
+    }
 
+    // Headers past MAX_HEADERS or MAX_HEADER_LENGTH are skipped
     int header_length = end - curr;
-    if (header_length < MAX_HEADER_LENGTH) {
+    if (header_length < MAX_HEADER_LENGTH &&
+        req.header_count < MAX_HEADERS) {
       strncpy(req.headers[req.header_count], curr,
               header_length); // copy into arr
       req.headers[req.header_count][header_length] = '\0';
@@ -166,7 +391,14 @@ HttpRequest parse_request(const char *request) {
     curr = end + 2; // Move past \r\n
   }
 
+  // Only a complete request may change the store
+  if (strcmp(req.method, "DELETE") == 0) {
+    req.response_code = index != -1 && delete_endpoint_data(index) ? 204 : 404;
+  }
+
   char *contentType = NULL;
+  long content_length = -1;
+  _Bool chunked = 0;
   if (requireBody) {
     _Bool hasContentLength = 0;
     _Bool hasContentType = 0;
@@ -179,9 +411,20 @@ HttpRequest parse_request(const char *request) {
         while (*value == ' ')
           value++; // Skip spaces
 
-        if (strcmp(header, "Content-Length") == 0)
+        // Field names are case insensitive, as in request_complete()
+        if (strcasecmp(header, "Content-Length") == 0) {
+          char *digits_end;
+          content_length = strtol(value, &digits_end, 10);
+          if (digits_end == value || content_length < 0) {
+            req.response_code = 400; // Not a length
+            return req;
+          }
           hasContentLength = 1;
-        else if (strcmp(header, "Content-Type") == 0) {
+        } else if (strcasecmp(header, "Transfer-Encoding") == 0 &&
+                 strcasecmp(value, "chunked") == 0) {
+          chunked = 1;
+          hasContentLength = 1; // Chunk sizes frame the body instead
+        } else if (strcasecmp(header, "Content-Type") == 0) {
           contentType = value;
           hasContentType = 1;
         }
@@ -197,13 +440,17 @@ HttpRequest parse_request(const char *request) {
   }
 
   if (index != -1) {
-    if (contentType != NULL && strcmp(contentType, "text/plain") == 0 ||
-        strcmp(contentType, "text/html") == 0 ||
-        strcmp(contentType, "text/css") == 0 ||
-        strcmp(contentType, "text/javascript") == 0 ||
-        strcmp(contentType, "application/json") == 0 ||
-        strcmp(contentType, "application/xml") == 0) {
-      req = body_parser(curr, req, index);
+    if (contentType != NULL && (strcmp(contentType, "text/plain") == 0 ||
+                                strcmp(contentType, "text/html") == 0 ||
+                                strcmp(contentType, "text/css") == 0 ||
+                                strcmp(contentType, "text/javascript") == 0 ||
+                                strcmp(contentType, "application/json") == 0 ||
+                                strcmp(contentType, "application/xml") == 0)) {
+      if (chunked) {
+        req = chunked_body_parser(curr, req, index);
+      } else {
+        req = body_parser(curr, req, index, content_length);
+      }
     } else {
       // Add other media types later
       req.response_code = 415; // Unsupported Media Type
@@ -214,9 +461,9 @@ HttpRequest parse_request(const char *request) {
   return req;
 }
 
-char *get_endpoint_data(int index) {
+// Called with the endpoint's mutex held
+static char *copy_endpoint_data(int index) {
   char *data_copy = NULL;
-  pthread_mutex_lock(&endpoints[index].mutex);
 
   if (endpoints[index].data != NULL) {
     size_t data_length = strlen(endpoints[index].data);
@@ -225,7 +472,35 @@ char *get_endpoint_data(int index) {
       strcpy(data_copy, endpoints[index].data);
     }
   }
+  return data_copy;
+}
 
+// Copy of the data stored at path, NULL if there is none. The endpoint is
+// locked before the lookup lets go, so its slot can't be handed to another
+// path in between
+char *find_endpoint_data(const char *path) {
+  pthread_mutex_lock(&endpoints_mutex);
+  int index = -1;
+  for (int i = 0; i < endpoint_count; i++) {
+    if (strcmp(endpoints[i].path, path) == 0) {
+      index = i;
+      break;
+    }
+  }
+  if (index == -1) {
+    pthread_mutex_unlock(&endpoints_mutex);
+    return NULL;
+  }
+  pthread_mutex_lock(&endpoints[index].mutex);
+  pthread_mutex_unlock(&endpoints_mutex);
+  char *data_copy = copy_endpoint_data(index);
+  pthread_mutex_unlock(&endpoints[index].mutex);
+  return data_copy;
+}
+
+char *get_endpoint_data(int index) {
+  pthread_mutex_lock(&endpoints[index].mutex);
+  char *data_copy = copy_endpoint_data(index);
   pthread_mutex_unlock(&endpoints[index].mutex);
   return data_copy;
 }
@@ -272,6 +547,17 @@ void set_response_body(HttpResponse *response, const char *body,
   }
 }
 
+int add_response_header(HttpResponse *response, const char *header) {
+  if (response->header_count >= MAX_HEADERS) {
+    return -1;
+  }
+  strncpy(response->headers[response->header_count], header,
+          MAX_HEADER_LENGTH - 1);
+  response->headers[response->header_count][MAX_HEADER_LENGTH - 1] = '\0';
+  response->header_count++;
+  return 0;
+}
+
 char *serialize_response(HttpResponse *response, size_t *total_length) {
   // Calculate the total length of the response
   *total_length = snprintf(NULL, 0, "HTTP/1.1 %d %s\r\n", response->status_code,
@@ -294,11 +580,39 @@ char *serialize_response(HttpResponse *response, size_t *total_length) {
     current += sprintf(current, "%s\r\n", response->headers[i]);
   }
   current += sprintf(current, "\r\n");
-  memcpy(current, response->body, response->body_length);
+  if (response->body_length > 0) {
+    memcpy(current, response->body, response->body_length);
+  }
 
   return serialized;
 }
 
+// Wrap data_length bytes, written by a producer at
+// buffer + STREAM_CHUNK_HEADER, in chunk framing. Returns where the frame
+// starts within buffer
+char *frame_chunk(char *buffer, size_t data_length, size_t *frame_length) {
+  char size_line[STREAM_CHUNK_HEADER + 1];
+  int header_length =
+      snprintf(size_line, sizeof(size_line), "%zx\r\n", data_length);
+  char *frame = buffer + STREAM_CHUNK_HEADER - header_length;
+  memcpy(frame, size_line, header_length);
+  memcpy(buffer + STREAM_CHUNK_HEADER + data_length, "\r\n", 2);
+  *frame_length = header_length + data_length + 2;
+  return frame;
+}
+
+// body_producer_t over a buffer_stream_t
+ssize_t buffer_producer(void *ctx, char *buf, size_t size) {
+  buffer_stream_t *stream = (buffer_stream_t *)ctx;
+  size_t remaining = stream->length - stream->offset;
+  if (size > remaining) {
+    size = remaining;
+  }
+  memcpy(buf, stream->data + stream->offset, size);
+  stream->offset += size;
+  return size;
+}
+
 void update_response_status(HttpResponse *response, int status_code,
                             const char *status_message) {
   if (response != NULL) {
@@ -338,4 +652,5 @@ void free_endpoint_data() {
     pthread_mutex_unlock(&endpoints[i].mutex);
     pthread_mutex_destroy(&endpoints[i].mutex);
   }
+  endpoint_count = 0;
 }
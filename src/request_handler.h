@@ -5,12 +5,24 @@
 #include <string.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 #define MAX_HEADERS 20
 #define MAX_HEADER_LENGTH 200
 #define MAX_ENDPOINTS 10
 #define MAX_PATH_LENGTH 10
 
+#define STREAM_CHUNK_SIZE 16384 // Largest body slice a producer fills per chunk
+#define STREAM_CHUNK_HEADER 10  // Room for the hex size line, "ffffffff\r\n"
+#define STREAM_BUFFER_SIZE (STREAM_CHUNK_HEADER + STREAM_CHUNK_SIZE + 2)
+
+// Store mutations reported to the mutation hook
+#define STORE_SET 1
+#define STORE_DELETE 2
+
+#define CHUNKED_MALFORMED -1
+#define CHUNKED_INCOMPLETE -2
+
 struct content_type {
     const char *extension;
     const char *type;
@@ -35,6 +47,22 @@ typedef struct {
     size_t body_length;
 } HttpResponse;
 
+// Fills buf with up to size bytes of response body. Returns the number of
+// bytes written, 0 once the body is complete or -1 to abort the response
+typedef ssize_t (*body_producer_t)(void *ctx, char *buf, size_t size);
+
+// Producer state for streaming a body that is already in memory
+typedef struct {
+    const char *data;
+    size_t length;
+    size_t offset;
+} buffer_stream_t;
+
+// Called with the endpoint's mutex held, so hooks see each endpoint's
+// mutations in the order they were applied. Only the path is passed, the
+// value is read back from the store when it's needed
+typedef void (*mutation_hook_t)(int op, const char *path);
+
 typedef struct {
     char path[MAX_PATH_LENGTH];
     char *data;
@@ -43,11 +71,24 @@ typedef struct {
 
 const char *get_status_message(int status_code);
 HttpRequest parse_request(const char *request);
+int request_complete(const char *request, size_t length);
+ssize_t decode_chunked(const char *src, size_t length, char *dst);
+int find_endpoint(const char *path);
 int find_or_create_endpoint(const char* path);
+int find_or_reuse_endpoint(const char *path);
+char *find_endpoint_data(const char *path);
 char* get_endpoint_data(int index);
+int store_endpoint_data(int index, const char *data, size_t length);
+int delete_endpoint_data(int index);
+int get_endpoint_count();
+const char *get_endpoint_path(int index);
+void set_mutation_hook(mutation_hook_t hook);
 HttpResponse *create_response(int status_code, const char **headers, int header_count);
 void set_response_body(HttpResponse *response, const char *body, size_t body_length);
+int add_response_header(HttpResponse *response, const char *header);
 char *serialize_response(HttpResponse *response, size_t *total_length);
+char *frame_chunk(char *buffer, size_t data_length, size_t *frame_length);
+ssize_t buffer_producer(void *ctx, char *buf, size_t size);
 void update_response_status(HttpResponse *response, int status_code, const char *status_message);
 void free_response(HttpResponse *response);
 void print_request(HttpRequest *req);
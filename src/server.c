@@ -1,6 +1,10 @@
+#include "coro.h"
 #include "http_server.h"
+#include "replication.h"
 #include "request_handler.h"
 #include "thread_pool.h"
+#include "tls.h"
+#include "trace.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <signal.h>
@@ -9,6 +13,8 @@
 #include <time.h>
 #include <unistd.h>
 
+static thread_pool_t *pool = NULL; // Request workers, NULL in coroutine mode
+
 // volatile is used to ensure changes made by the signal handler are immediately
 // visible in the main loop prevents missing the signal to stop the server
 volatile sig_atomic_t keep_running = 1;
@@ -23,90 +29,340 @@ void cleanup(int server_fd) { // Shutdown
   free_endpoint_data();
 }
 
+// Hand an accepted (and, with TLS, handshaken) socket to the request workers
+// or, in coroutine mode, to a reactor
+static void dispatch_request(int client_socket) {
+  trace_mark(client_socket, TRACE_ENQUEUE);
+  if (pool != NULL) {
+    thread_pool_add_task(pool, client_socket);
+  } else {
+    coro_spawn(client_socket);
+  }
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-p port] [-c cert.pem -k key.pem] "
+          "[[-n] [-m min:max] | -a] [-R port | -F host:port] "
+          "[-t trace.json [-s rate]]\n",
+          prog);
+  fprintf(stderr, "  -p      listen on this port (default %d)\n", PORT);
+  fprintf(stderr, "  -c, -k  serve HTTPS with this certificate and key\n");
+  fprintf(stderr, "  -n      pin workers and queues per NUMA node\n");
+  fprintf(stderr, "  -m      size the pool between min and max threads by "
+                  "load (default 6:6)\n");
+  fprintf(stderr, "  -a      run handlers as coroutines on %d reactor threads\n",
+          CORO_REACTOR_THREADS);
+  fprintf(stderr, "  -R      lead, streaming store mutations to followers\n");
+  fprintf(stderr, "  -F      follow a leader's replication port, read only\n");
+  fprintf(stderr, "  -t      trace sampled requests, written here on shutdown\n");
+  fprintf(stderr, "  -s      trace 1 in this many connections (default %d)\n",
+          TRACE_SAMPLE_RATE);
+}
+
+// Read until request_complete() is satisfied, the peer stops sending or the
+// request outgrows MAX_REQUEST_SIZE. Returns a null terminated heap buffer
+static char *read_request(int client_socket, int *too_large) {
+  size_t capacity = BUFFER_SIZE;
+  size_t used = 0;
+  char *buffer = malloc(capacity);
+  *too_large = 0;
+  if (buffer == NULL) {
+    return NULL;
+  }
+  buffer[0] = '\0';
+
+  while (!request_complete(buffer, used)) {
+    if (used + 1 == capacity) { // Grow, keeping room for the null terminator
+      if (capacity >= MAX_REQUEST_SIZE) {
+        *too_large = 1;
+        break;
+      }
+      char *grown = realloc(buffer, capacity * 2);
+      if (grown == NULL) {
+        free(buffer);
+        return NULL;
+      }
+      buffer = grown;
+      capacity *= 2;
+    }
+
+    ssize_t bytes_read =
+        conn_read(client_socket, buffer + used, capacity - used - 1);
+    if (bytes_read < 0) {
+      free(buffer);
+      return NULL;
+    }
+    if (bytes_read == 0) {
+      break; // Peer closed, parse what arrived
+    }
+    used += bytes_read;
+    buffer[used] = '\0'; // Null terminate the buffer
+  }
+  return buffer;
+}
+
+// Send the response headers, then the body as chunks pulled from produce.
+// The producer only runs once the previous chunk is written, so it is paused
+// whenever the socket's send buffer is full
+static int send_stream_response(int client_socket, HttpResponse *response,
+                                body_producer_t produce, void *ctx) {
+  add_response_header(response, "Transfer-Encoding: chunked");
+  size_t head_length;
+  char *head = serialize_response(response, &head_length);
+  char *buffer = malloc(STREAM_BUFFER_SIZE);
+  if (head == NULL || buffer == NULL ||
+      conn_write(client_socket, head, head_length) < 0) {
+    free(head);
+    free(buffer);
+    return -1;
+  }
+  free(head);
+
+  while (1) {
+    ssize_t produced =
+        produce(ctx, buffer + STREAM_CHUNK_HEADER, STREAM_CHUNK_SIZE);
+    if (produced < 0) {
+      break; // Abort, the missing last chunk tells the client it's truncated
+    }
+    if (produced == 0) {
+      free(buffer);
+      return conn_write(client_socket, "0\r\n\r\n", 5) < 0 ? -1 : 0;
+    }
+    size_t frame_length;
+    char *frame = frame_chunk(buffer, produced, &frame_length);
+    if (conn_write(client_socket, frame, frame_length) < 0) {
+      break;
+    }
+  }
+  free(buffer);
+  return -1;
+}
+
+// Every request ends here. The trace leaves the fd before it can be reused
+// and its close span covers the TLS shutdown and close()
+static void close_client(int client_socket) {
+  trace_record_t *trace = trace_detach(client_socket);
+  conn_close(client_socket);
+  trace_finish(trace);
+}
+
+static void send_metrics(int client_socket) {
+  char body[1024];
+  char response[1200];
+  int body_length = replication_metrics(body, sizeof(body));
+  int length = snprintf(response, sizeof(response),
+                        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                        "Content-Length: %d\r\n\r\n%s",
+                        body_length, body);
+  conn_write(client_socket, response, length);
+}
+
 void handle_client(int client_socket) {
-  char buffer[BUFFER_SIZE] = {0};
+  trace_mark(client_socket, TRACE_DEQUEUE);
 
   // Read the request
-  ssize_t bytes_read = read(client_socket, buffer, BUFFER_SIZE);
-  if (bytes_read < 0) {
+  int too_large;
+  char *buffer = read_request(client_socket, &too_large);
+  if (buffer == NULL) {
     perror("Read failed");
-    close(client_socket);
+    close_client(client_socket);
     return;
   }
-  buffer[bytes_read] = '\0'; // Null terminate the buffer
 
-  // Parse and print the request
-  HttpRequest req = parse_request(buffer);
+  trace_mark(client_socket, TRACE_READ);
+
+  // Continue the caller's trace, or start one if this request is sampled
+  char traceparent[TRACE_HEADER_SIZE];
+  int has_traceparent =
+      trace_context(client_socket, buffer, traceparent, sizeof(traceparent));
+
+  char method[10] = {0}, path[256] = {0};
+  sscanf(buffer, "%9s %255s", method, path);
+  if (strcmp(method, "GET") == 0 && strcmp(path, METRICS_PATH) == 0) {
+    send_metrics(client_socket);
+    trace_mark(client_socket, TRACE_WRITTEN);
+    trace_describe(client_socket, method, path, 200);
+    free(buffer);
+    close_client(client_socket);
+    return;
+  }
+
+  // Parse and print the request, oversized ones are never applied and
+  // followers only take writes from their leader
+  HttpRequest req = {0};
+  if (too_large) {
+    req.response_code = 413;
+  } else if (replication_is_follower() && strcmp(method, "GET") != 0) {
+    req.response_code = 403;
+  } else {
+    req = parse_request(buffer);
+  }
+  trace_mark(client_socket, TRACE_PARSED);
   print_request(&req);
   printf("---------------\n");
+  free(buffer); // req.body points into buffer
 
   const char *headers[] = {"Content-Type: text/plain", "Server: MyServer/1.0"};
   HttpResponse *response = create_response(200, headers, 2);
+  if (response != NULL && has_traceparent > 0) {
+    add_response_header(response, traceparent);
+  }
 
   if (response == NULL) {
     const char *error_response =
         "HTTP/1.1 500 Internal Server Error\r\nContent-Type: "
         "text/plain\r\nContent-Length: 21\r\n\r\nInternal Server Error\n";
-    write(client_socket, error_response, strlen(error_response));
-    close(client_socket);
+    conn_write(client_socket, error_response, strlen(error_response));
+    trace_describe(client_socket, method, path, 500);
+    close_client(client_socket);
     return;
   }
 
   if (req.response_code == 200) {
-    int index = find_or_create_endpoint(req.path);
-    if (index != -1) {
-      char *endpoint_data = get_endpoint_data(index);
-      if (endpoint_data != NULL) {
-        set_response_body(response, endpoint_data, strlen(endpoint_data));
-        free(endpoint_data);
-      } else {
-        update_response_status(response, 404, "Not Found");
-        set_response_body(response, "No data found\n", 13);
+    // Writes created their endpoint while parsing, reads never create one
+    char *endpoint_data = find_endpoint_data(req.path);
+    trace_mark(client_socket, TRACE_STORE);
+    size_t data_length = endpoint_data ? strlen(endpoint_data) : 0;
+    if (data_length > STREAM_CHUNK_SIZE &&
+        strcmp(req.version, "HTTP/1.1") == 0) {
+      // Stream large bodies straight from the copy instead of building
+      // the whole message. Terminator swaps for the newline other bodies get
+      endpoint_data[data_length] = '\n';
+      buffer_stream_t stream = {endpoint_data, data_length + 1, 0};
+      if (send_stream_response(client_socket, response, buffer_producer,
+                               &stream) != 0) {
+        perror("Failed to stream response");
       }
+      trace_mark(client_socket, TRACE_WRITTEN);
+      trace_describe(client_socket, method, path, response->status_code);
+      free(endpoint_data);
+      free_response(response);
+      close_client(client_socket);
+      return;
+    }
+    if (endpoint_data != NULL) {
+      set_response_body(response, endpoint_data, data_length);
+      free(endpoint_data);
     } else {
-      // Handle the case when no endpoint was found or created
-      update_response_status(response, 500, "Internal Server Error");
-      set_response_body(response, "Internal Server Error", 21);
+      update_response_status(response, 404, "Not Found");
+      set_response_body(response, "No data found\n", 13);
     }
   } else if (req.response_code == 204) {
-    update_response_status(response, 204, "Internal Server Error");
+    update_response_status(response, 204, get_status_message(204));
     // No body for 204 response
   } else {
+    update_response_status(response, req.response_code,
+                           get_status_message(req.response_code));
     set_response_body(response, get_status_message(req.response_code),
                       strlen(get_status_message(req.response_code)));
   }
 
-  char content_length[32];
-  snprintf(content_length, sizeof(content_length), "Content-Length: %zu",
-           response->body_length);
+  if (response->status_code != 204) { // A 204 must not carry Content-Length
+    char content_length[32];
+    snprintf(content_length, sizeof(content_length), "Content-Length: %zu",
+             response->body_length);
+    add_response_header(response, content_length);
+  }
 
   size_t response_length;
   char *serialized_response = serialize_response(response, &response_length);
   // Convert response to string
   if (serialized_response != NULL) {
     ssize_t bytes_written =
-        write(client_socket, serialized_response, response_length);
+        conn_write(client_socket, serialized_response, response_length);
     if (bytes_written < 0) {
       // Handle error
       perror("Failed to write response");
-    } else if ((size_t)bytes_written < response_length) {
-      // Handle partial write
-      fprintf(stderr, "Partial write occurred\n");
     }
     free(serialized_response);
-
-    if (response != NULL) {
-      free_response(response);
-    }
-    close(client_socket);
   }
+  trace_mark(client_socket, TRACE_WRITTEN);
+  trace_describe(client_socket, method, path, response->status_code);
+
+  free_response(response);
+  close_client(client_socket);
 }
 
 // Setup scoket, bind, listen, accept, and handle client
-int main() {
+int main(int argc, char *argv[]) {
   int server_fd, new_socket;
   struct sockaddr_in address;
   int addrlen = sizeof(address);
+  const char *cert_file = NULL;
+  const char *key_file = NULL;
+  int numa_aware = 0;
+  int coroutines = 0;
+  int min_threads = 6, max_threads = 6;
+  int pool_sized = 0;
+  int port = PORT;
+  int replication_port = 0;
+  char *leader_address = NULL;
+  const char *trace_file = NULL;
+  int trace_rate = TRACE_SAMPLE_RATE;
+
+  int opt_char;
+  while ((opt_char = getopt(argc, argv, "p:c:k:nm:aR:F:t:s:")) != -1) {
+    switch (opt_char) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'R':
+      replication_port = atoi(optarg);
+      break;
+    case 'F':
+      leader_address = optarg;
+      break;
+    case 'c':
+      cert_file = optarg;
+      break;
+    case 'k':
+      key_file = optarg;
+      break;
+    case 'n':
+      numa_aware = 1;
+      break;
+    case 'm':
+      if (sscanf(optarg, "%d:%d", &min_threads, &max_threads) != 2 ||
+          min_threads < 1 || max_threads < min_threads) {
+        usage(argv[0]);
+        return -1;
+      }
+      pool_sized = 1;
+      break;
+    case 'a':
+      coroutines = 1;
+      break;
+    case 't':
+      trace_file = optarg;
+      break;
+    case 's':
+      trace_rate = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if (coroutines && (numa_aware || pool_sized)) {
+    usage(argv[0]); // Coroutine mode runs no worker pool to pin or size
+    return -1;
+  }
+  if ((cert_file == NULL) != (key_file == NULL)) {
+    usage(argv[0]); // TLS needs both a certificate and a key
+    return -1;
+  }
+  char *leader_port = leader_address ? strrchr(leader_address, ':') : NULL;
+  if ((leader_address != NULL && leader_port == NULL) ||
+      (leader_address != NULL && replication_port != 0)) {
+    usage(argv[0]); // A follower needs host:port and can't lead as well
+    return -1;
+  }
+
+  if (trace_file != NULL && trace_init(trace_file, trace_rate) != 0) {
+    usage(argv[0]); // Sample rate must be at least 1
+    return -1;
+  }
 
   // Create TCP/IP socket
   if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
@@ -130,7 +386,7 @@ int main() {
   // Config server address
   address.sin_family = AF_INET;                     // Domain is IPv4
   address.sin_addr.s_addr = inet_addr("127.0.0.1"); // Listen on Localhost
-  address.sin_port = htons(PORT);                   // Port 8080
+  address.sin_port = htons(port);                   // Port 8080 by default
   // sin = socket internet
 
   // bind() takes socket file descriptor, address to bind to, and size of
@@ -150,15 +406,52 @@ int main() {
 
   // Set up signal handling
   signal(SIGINT, sigint_handler);
+  // A client that goes away mid-write, or before a TLS close_notify, must
+  // only fail that write instead of killing the server
+  signal(SIGPIPE, SIG_IGN);
+
+  if (coroutines) {
+    // A few reactor threads keep many slow requests in flight
+    if (coro_start(CORO_REACTOR_THREADS, handle_client) != 0) {
+      fprintf(stderr, "Failed to start coroutine reactors\n");
+      return -1;
+    }
+  } else {
+    // Create a thread pool with 6 threads, or sized between -m min:max
+    pool = thread_pool_create_adaptive(min_threads, max_threads, numa_aware,
+                                       handle_client);
+    if (pool == NULL) {
+      perror("Failed to create thread pool");
+      return -1;
+    }
+  }
 
-  thread_pool_t *pool =
-      thread_pool_create(6); // Create a thread pool with 6 threads
-  if (pool == NULL) {
-    perror("Failed to create thread pool");
+  // Handshakes run on their own threads, then the socket goes to the pool
+  if (cert_file != NULL &&
+      tls_init(cert_file, key_file, dispatch_request) != 0) {
+    fprintf(stderr, "Failed to set up TLS\n");
+    thread_pool_destroy(pool);
+    if (coroutines) {
+      coro_stop();
+    }
     return -1;
   }
 
-  printf("Server listening on localhost:%d\n", PORT);
+  if (replication_port != 0 && replication_start_leader(replication_port) != 0) {
+    fprintf(stderr, "Failed to start replication\n");
+    return -1;
+  }
+  if (leader_port != NULL) {
+    *leader_port = '\0';
+    if (replication_start_follower(leader_address, atoi(leader_port + 1)) !=
+        0) {
+      fprintf(stderr, "Failed to start replication\n");
+      return -1;
+    }
+  }
+
+  printf("Server listening on %s://localhost:%d\n",
+         tls_enabled() ? "https" : "http", port);
   printf("Press Ctrl+C to stop the server.\n");
 
   while (keep_running) {
@@ -185,9 +478,21 @@ int main() {
     }
 
     // Add the new socket to the thread pool
-    thread_pool_add_task(pool, new_socket);
+    trace_accept(new_socket);
+    if (tls_enabled()) {
+      tls_accept(new_socket);
+    } else {
+      dispatch_request(new_socket);
+    }
   }
+  replication_stop();
+  tls_cleanup(); // Stop handshakes before the pool they feed
   thread_pool_destroy(pool);
+  if (coroutines) {
+    coro_stop();
+  }
+  trace_flush(); // Request threads are gone, the rings are complete
+  trace_cleanup();
   cleanup(server_fd); // Close the server socket and free endpoint data
   return 0;
 }
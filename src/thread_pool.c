@@ -1,123 +1,440 @@
+#define _GNU_SOURCE
 #include "thread_pool.h"
+#include "numa.h"
+#include <linux/futex.h>
 #include <pthread.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct pool_node {
+    task_queue_t *queue;
+    pthread_mutex_t queue_mutex;
+    worker_t *idle;    // Parked workers, most recently parked first
+    int pending;       // Queued sockets, read without the mutex when picking a node
+    int worker_count;  // Live workers serving this node
+    int pinned;        // Workers are bound to the CPUs in numa.cpus
+    numa_node_t numa;
+};
+
+struct worker {
+    pthread_t thread;
+    thread_pool_t *pool;
+    pool_node_t *node;   // Queue this worker serves
+    uint32_t parked;     // futex word, 1 while on the node's idle list
+    int retire;          // Set by the controller to shrink the pool
+    int live;            // Slot has a running thread
+    worker_t *next_idle;
+};
 
 static void* worker_thread(void* arg);
+static void* controller_thread(void* arg);
+
+static long futex(uint32_t* word, int op, uint32_t value) {
+    return syscall(SYS_futex, word, op, value, NULL, NULL, 0);
+}
+
+// Take the most recently parked worker off the idle list. Called with the
+// node's mutex held, wake() it once the mutex is released
+static worker_t* pop_idle(pool_node_t* node) {
+    worker_t* worker = node->idle;
+    if (worker != NULL) {
+        node->idle = worker->next_idle;
+        __atomic_store_n(&worker->parked, 0, __ATOMIC_RELEASE);
+    }
+    return worker;
+}
+
+static void wake(worker_t* worker) {
+    if (worker != NULL) {
+        futex(&worker->parked, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+// Set by thread_pool_destroy, read by workers and the controller
+static int stopping(thread_pool_t* pool) {
+    return __atomic_load_n(&pool->stop, __ATOMIC_RELAXED);
+}
+
+static void free_nodes(thread_pool_t* pool, int node_count) {
+    for (int i = 0; i < node_count; i++) {
+        pthread_mutex_destroy(&pool->nodes[i].queue_mutex);
+        free_queue(pool->nodes[i].queue);
+    }
+    free(pool->nodes);
+}
+
+// Start a worker in a free slot, serving node
+static int spawn_worker(thread_pool_t* pool, pool_node_t* node) {
+    worker_t* worker = NULL;
+    for (int i = 0; i < pool->max_threads; i++) {
+        if (!pool->workers[i].live) {
+            worker = &pool->workers[i];
+            break;
+        }
+    }
+    if (worker == NULL) {
+        return -1;
+    }
+    worker->pool = pool;
+    worker->node = node;
+    worker->parked = 0;
+    worker->retire = 0;
+    worker->next_idle = NULL;
+
+    // Start pinned threads on their node so the first touch of their
+    // stack, request buffers and malloc arena is node local
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (node->pinned) {
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &node->numa.cpus);
+    }
+    int rc = pthread_create(&worker->thread, &attr, worker_thread, worker);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        return -1;
+    }
+    worker->live = 1;
+    node->worker_count++;
+    pool->thread_count++;
+    return 0;
+}
 
-thread_pool_t* thread_pool_create(int thread_count) {
-    thread_pool_t* pool = (thread_pool_t *)malloc(sizeof(thread_pool_t));
+// numa == NULL creates a single unpinned node
+static thread_pool_t* pool_create(int min_threads, int max_threads,
+                                  task_handler_t handler,
+                                  const numa_node_t* numa, int node_count) {
+    thread_pool_t* pool = (thread_pool_t *)calloc(1, sizeof(thread_pool_t));
     if (pool == NULL) {
         return NULL;
     }
 
-    pool->thread_count = thread_count;
-    pool->threads = (pthread_t *)malloc(thread_count * sizeof(pthread_t));
-    if (pool->threads == NULL) {
-        free(pool);
-        return NULL;
+    // Every node needs at least one worker or its queue never drains
+    if (numa == NULL || node_count < 1) {
+        node_count = 1;
+    }
+    if (node_count > min_threads) {
+        node_count = min_threads;
     }
 
-    pool->queue = create_queue();
-    if (pool->queue == NULL) {
-        free(pool->threads);
+    pool->min_threads = min_threads;
+    pool->max_threads = max_threads;
+    pool->node_count = node_count;
+    pool->handler = handler;
+    pool->workers = (worker_t *)calloc(max_threads, sizeof(worker_t));
+    if (pool->workers == NULL) {
         free(pool);
         return NULL;
     }
 
-    // Mutex to protect shared data from being simultaneous accessed by multiple threads
-    if (pthread_mutex_init(&pool->queue_mutex, NULL) != 0) {
-        free(pool->queue);
-        free(pool->threads);
+    pool->nodes = (pool_node_t *)calloc(node_count, sizeof(pool_node_t));
+    if (pool->nodes == NULL) {
+        free(pool->workers);
         free(pool);
         return NULL;
     }
 
-    // Condition variable to signal threads when there is work to do
-    if (pthread_cond_init(&pool->queue_cond, NULL) != 0) {
-        pthread_mutex_destroy(&pool->queue_mutex);
-        free(pool->queue);
-        free(pool->threads);
-        free(pool);
-        return NULL;
+    for (int i = 0; i < node_count; i++) {
+        pool_node_t* node = &pool->nodes[i];
+        node->queue = create_queue();
+        node->pinned = numa != NULL;
+        if (numa != NULL) {
+            node->numa = numa[i];
+        }
+
+        // Mutex to protect shared data from being simultaneous accessed by multiple threads
+        if (pthread_mutex_init(&node->queue_mutex, NULL) != 0) {
+            free_queue(node->queue);
+            free_nodes(pool, i);
+            free(pool->workers);
+            free(pool);
+            return NULL;
+        }
     }
 
     pool->stop = 0; // Stop flag
 
-    // Create worker threads
-    for (int i = 0; i < thread_count; i++) {
-        if (pthread_create(&pool->threads[i], NULL, worker_thread, pool) != 0) {
+    // Create worker threads, spread round robin over the nodes
+    for (int i = 0; i < min_threads; i++) {
+        if (spawn_worker(pool, &pool->nodes[i % node_count]) != 0) {
+            thread_pool_destroy(pool); // Only joins the threads that started
+            return NULL;
+        }
+    }
+
+    // Grow and shrink between the bounds as load changes
+    if (min_threads < max_threads) {
+        if (pthread_create(&pool->controller, NULL, controller_thread, pool) != 0) {
             thread_pool_destroy(pool);
             return NULL;
         }
+        pool->adaptive = 1;
     }
     return pool;
 }
 
+thread_pool_t* thread_pool_create(int thread_count, task_handler_t handler) {
+    return pool_create(thread_count, thread_count, handler, NULL, 1);
+}
+
+// Pool sized between min_threads and max_threads by queue wait and worker
+// utilization, starting at min_threads. numa_aware gives each NUMA node a
+// queue with its workers pinned to that node's CPUs, falling back to a plain
+// pool when the topology can't be read
+thread_pool_t* thread_pool_create_adaptive(int min_threads, int max_threads,
+                                           int numa_aware, task_handler_t handler) {
+    if (min_threads < 1 || max_threads < min_threads) {
+        return NULL;
+    }
+    if (!numa_aware) {
+        return pool_create(min_threads, max_threads, handler, NULL, 1);
+    }
+
+    numa_node_t numa[MAX_NUMA_NODES];
+    int node_count = numa_detect(numa, MAX_NUMA_NODES);
+    if (node_count == 0) {
+        fprintf(stderr, "NUMA topology not found, workers will not be pinned\n");
+        return pool_create(min_threads, max_threads, handler, NULL, 1);
+    }
+    return pool_create(min_threads, max_threads, handler, numa, node_count);
+}
+
 static void* worker_thread(void* arg) {
-    thread_pool_t* pool = (thread_pool_t *)arg;
+    worker_t* worker = (worker_t *)arg;
+    thread_pool_t* pool = worker->pool;
+    pool_node_t* node = worker->node;
     int client_socket;
+    uint64_t enqueued_ns;
 
     while (1) {
-        pthread_mutex_lock(&pool->queue_mutex);
+        pthread_mutex_lock(&node->queue_mutex);
 
-        // While the queue is empty and stop flag is not set, wait on the condition variable
-        while (is_empty(pool->queue) && !pool->stop) {
-            pthread_cond_wait(&pool->queue_cond, &pool->queue_mutex);
+        // While the queue is empty, park on this worker's own futex until
+        // thread_pool_add_task hands it work, so each task wakes one thread
+        while (is_empty(node->queue) && !stopping(pool) && !worker->retire) {
+            __atomic_store_n(&worker->parked, 1, __ATOMIC_RELAXED);
+            worker->next_idle = node->idle;
+            node->idle = worker;
+            pthread_mutex_unlock(&node->queue_mutex);
+
+            while (__atomic_load_n(&worker->parked, __ATOMIC_ACQUIRE) == 1) {
+                futex(&worker->parked, FUTEX_WAIT_PRIVATE, 1);
+            }
+            pthread_mutex_lock(&node->queue_mutex);
         }
 
-        // If stop flag is set, unlock mutex and break the loop
-        if (pool->stop) {
-            pthread_mutex_unlock(&pool->queue_mutex);
+        // If stop flag is set, or the controller is shrinking the pool, exit
+        if (stopping(pool) || worker->retire) {
+            pthread_mutex_unlock(&node->queue_mutex);
             break;
         }
 
-        client_socket = dequeue(pool->queue);
+        client_socket = dequeue_timed(node->queue, &enqueued_ns);
+        __atomic_sub_fetch(&node->pending, 1, __ATOMIC_RELAXED);
+
+        pthread_mutex_unlock(&node->queue_mutex);
 
-        pthread_mutex_unlock(&pool->queue_mutex);
+        __atomic_add_fetch(&pool->wait_ns, queue_now_ns() - enqueued_ns,
+                           __ATOMIC_RELAXED);
+        __atomic_add_fetch(&pool->wait_count, 1, __ATOMIC_RELAXED);
 
-        // Call handle_client() with the dequeued client socket
-        handle_client(client_socket);
+        // Call the pool's handler (e.g. handle_client()) with the dequeued client socket
+        __atomic_add_fetch(&pool->busy, 1, __ATOMIC_RELAXED);
+        pool->handler(client_socket);
+        __atomic_sub_fetch(&pool->busy, 1, __ATOMIC_RELAXED);
     }
     return NULL;
 }
 
+static int node_pending(pool_node_t* node) {
+    return __atomic_load_n(&node->pending, __ATOMIC_RELAXED);
+}
+
+// Retire one idle worker, never the last one serving a node
+static int retire_worker(thread_pool_t* pool) {
+    for (int i = 0; i < pool->node_count; i++) {
+        pool_node_t* node = &pool->nodes[i];
+        pthread_mutex_lock(&node->queue_mutex);
+        worker_t* worker = node->worker_count > 1 ? pop_idle(node) : NULL;
+        if (worker != NULL) {
+            worker->retire = 1;
+        }
+        pthread_mutex_unlock(&node->queue_mutex);
+
+        if (worker != NULL) {
+            wake(worker);
+            pthread_join(worker->thread, NULL);
+            worker->live = 0;
+            node->worker_count--;
+            pool->thread_count--;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Samples queue wait and utilization. Growing needs POOL_GROW_SAMPLES hot
+// samples in a row, shrinking POOL_SHRINK_SAMPLES quiet ones, one worker at a
+// time, so the pool doesn't flap around a threshold
+static void* controller_thread(void* arg) {
+    thread_pool_t* pool = (thread_pool_t *)arg;
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = POOL_SAMPLE_MS * 1000000};
+    int hot = 0, quiet = 0;
+
+    while (!stopping(pool)) {
+        nanosleep(&interval, NULL);
+
+        uint64_t wait_ns = __atomic_exchange_n(&pool->wait_ns, 0, __ATOMIC_RELAXED);
+        uint64_t wait_count = __atomic_exchange_n(&pool->wait_count, 0, __ATOMIC_RELAXED);
+        uint64_t wait_us = wait_count ? wait_ns / wait_count / 1000 : 0;
+
+        // Sockets stuck behind blocked workers never get dequeued, so the
+        // age of the oldest queued one counts as wait too
+        uint64_t now = queue_now_ns();
+        for (int i = 0; i < pool->node_count; i++) {
+            pool_node_t* node = &pool->nodes[i];
+            pthread_mutex_lock(&node->queue_mutex);
+            if (!is_empty(node->queue) &&
+                (now - node->queue->front->enqueued_ns) / 1000 > wait_us) {
+                wait_us = (now - node->queue->front->enqueued_ns) / 1000;
+            }
+            pthread_mutex_unlock(&node->queue_mutex);
+        }
+
+        int live = pool->thread_count;
+        int utilization = __atomic_load_n(&pool->busy, __ATOMIC_RELAXED) * 100 / live;
+
+        if (wait_us >= POOL_GROW_WAIT_US && utilization >= POOL_GROW_UTILIZATION) {
+            quiet = 0;
+            if (++hot < POOL_GROW_SAMPLES || live >= pool->max_threads) {
+                continue;
+            }
+            hot = 0;
+
+            // Grow by a quarter, onto the nodes with the most queued work
+            int grow = live / 4 > 1 ? live / 4 : 1;
+            for (int i = 0; i < grow && pool->thread_count < pool->max_threads; i++) {
+                pool_node_t* target = &pool->nodes[0];
+                for (int n = 1; n < pool->node_count; n++) {
+                    if (node_pending(&pool->nodes[n]) > node_pending(target)) {
+                        target = &pool->nodes[n];
+                    }
+                }
+                if (spawn_worker(pool, target) != 0) {
+                    break;
+                }
+            }
+            printf("Thread pool grew to %d workers (wait %lu us, %d%% busy)\n",
+                   pool->thread_count, (unsigned long)wait_us, utilization);
+        } else if (wait_us < POOL_GROW_WAIT_US / 10 &&
+                   utilization < POOL_SHRINK_UTILIZATION) {
+            hot = 0;
+            if (++quiet < POOL_SHRINK_SAMPLES || live <= pool->min_threads) {
+                continue;
+            }
+            quiet = 0;
+            if (retire_worker(pool) == 0) {
+                printf("Thread pool shrank to %d workers\n", pool->thread_count);
+            }
+        } else {
+            hot = quiet = 0;
+        }
+    }
+    return NULL;
+}
+
+// Queue work on the node whose CPU received the connection so its buffers
+// stay local. Only spill to another node once the home node is saturated
+static pool_node_t* pick_node(thread_pool_t* pool, int client_socket) {
+    if (pool->node_count == 1) {
+        return &pool->nodes[0];
+    }
+
+    int home = -1;
+#ifdef SO_INCOMING_CPU
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(client_socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+        cpu >= 0 && cpu < CPU_SETSIZE) {
+        for (int i = 0; i < pool->node_count; i++) {
+            if (CPU_ISSET(cpu, &pool->nodes[i].numa.cpus)) {
+                home = i;
+                break;
+            }
+        }
+    }
+#endif
+    if (home == -1) {
+        home = __atomic_fetch_add(&pool->next_node, 1, __ATOMIC_RELAXED) %
+               pool->node_count;
+    }
+    if (node_pending(&pool->nodes[home]) < POOL_NODE_SATURATION) {
+        return &pool->nodes[home];
+    }
+
+    int best = home;
+    for (int i = 0; i < pool->node_count; i++) {
+        if (node_pending(&pool->nodes[i]) < node_pending(&pool->nodes[best])) {
+            best = i;
+        }
+    }
+    return &pool->nodes[best];
+}
+
 void thread_pool_add_task(thread_pool_t* pool, int client_socket) {
-    if (pool == NULL || pool->queue == NULL) {
+    if (pool == NULL || pool->nodes == NULL) {
         return;  // Can't add task to a NULL pool or queue
     }
 
-    pthread_mutex_lock(&pool->queue_mutex);
+    pool_node_t* node = pick_node(pool, client_socket);
+    pthread_mutex_lock(&node->queue_mutex);
 
-    enqueue(pool->queue, client_socket);
+    enqueue(node->queue, client_socket);
+    __atomic_add_fetch(&node->pending, 1, __ATOMIC_RELAXED);
+    worker_t* idle = pop_idle(node);
 
-    pthread_cond_signal(&pool->queue_cond);  // Wake up one waiting thread
-    pthread_mutex_unlock(&pool->queue_mutex);
+    pthread_mutex_unlock(&node->queue_mutex);
+    wake(idle);  // Wake up one parked worker, busy ones pick it up otherwise
 }
 
 void thread_pool_destroy(thread_pool_t* pool) {
     if (pool == NULL) {
         return;  // Nothing to destroy if pool is NULL
     }
-    pool->stop = 1; // Set the stop flag
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_RELAXED); // Set the stop flag
 
-    // Lock the queue mutex
-    pthread_mutex_lock(&pool->queue_mutex);
+    // The controller starts and retires workers, stop it first
+    if (pool->adaptive) {
+        pthread_join(pool->controller, NULL);
+    }
 
-    // Wake up all waiting threads and Unlock the queue mutex
-    pthread_cond_broadcast(&pool->queue_cond);
-    pthread_mutex_unlock(&pool->queue_mutex);
+    // Wake up every parked worker on every node
+    for (int i = 0; i < pool->node_count; i++) {
+        pool_node_t* node = &pool->nodes[i];
+        pthread_mutex_lock(&node->queue_mutex);
+        worker_t* idle = node->idle;
+        node->idle = NULL;
+        for (worker_t* worker = idle; worker != NULL; worker = worker->next_idle) {
+            __atomic_store_n(&worker->parked, 0, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&node->queue_mutex);
+        for (worker_t* worker = idle; worker != NULL; worker = worker->next_idle) {
+            wake(worker);
+        }
+    }
 
     // Wait for all threads to finish
-    for (int i = 0; i < pool->thread_count; i++) {
-        pthread_join(pool->threads[i], NULL);
+    for (int i = 0; i < pool->max_threads; i++) {
+        if (pool->workers[i].live) {
+            pthread_join(pool->workers[i].thread, NULL);
+        }
     }
 
-    // Destroy the mutex and condition variable
-    pthread_mutex_destroy(&pool->queue_mutex);
-    pthread_cond_destroy(&pool->queue_cond);
-
-    // Free the threads array and Destroy the threads queue
-    free(pool->threads);
-    free_queue(pool->queue);
+    // Destroy the queues and their mutexes
+    free_nodes(pool, pool->node_count);
+    free(pool->workers);
 
     free(pool);
 }
@@ -4,16 +4,43 @@
 #include "queue.h"
 #include "http_server.h"
 
+// Pending sockets on a node's queue before new work spills to another node
+#define POOL_NODE_SATURATION 32
+
+// Adaptive sizing, the controller samples the pool every POOL_SAMPLE_MS
+#define POOL_SAMPLE_MS 100
+#define POOL_GROW_WAIT_US 2000     // Queue wait that signals too few workers
+#define POOL_GROW_UTILIZATION 75   // Percent of workers busy before growing
+#define POOL_GROW_SAMPLES 2        // Consecutive hot samples before growing
+#define POOL_SHRINK_UTILIZATION 25 // Percent busy below which workers idle
+#define POOL_SHRINK_SAMPLES 50     // Consecutive quiet samples before shrinking
+
+// Function run by a worker for every dequeued client socket
+typedef void (*task_handler_t)(int client_socket);
+
+typedef struct pool_node pool_node_t;
+typedef struct worker worker_t;
+
 typedef struct {
-    pthread_t *threads;
-    int thread_count;
-    task_queue_t *queue;
-    pthread_mutex_t queue_mutex;
-    pthread_cond_t queue_cond;
+    worker_t *workers;  // max_threads slots, live ones have a running thread
+    int thread_count;   // Live workers
+    int min_threads;
+    int max_threads;
+    pool_node_t *nodes; // One queue per NUMA node, a single node otherwise
+    int node_count;
+    unsigned int next_node; // Round robin for sockets with no known node
+    task_handler_t handler;
+    int busy;               // Workers inside handler
+    uint64_t wait_ns;       // Queue wait summed since the last sample
+    uint64_t wait_count;
+    pthread_t controller;
+    int adaptive;
     int stop;
 } thread_pool_t;
 
-thread_pool_t* thread_pool_create(int thread_count);
+thread_pool_t* thread_pool_create(int thread_count, task_handler_t handler);
+thread_pool_t* thread_pool_create_adaptive(int min_threads, int max_threads,
+                                           int numa_aware, task_handler_t handler);
 void thread_pool_add_task(thread_pool_t* pool, int client_socket);
 void thread_pool_destroy(thread_pool_t* pool);
 
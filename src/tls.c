@@ -0,0 +1,262 @@
+#include "tls.h"
+#include "coro.h"
+#include "http_server.h"
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef ENABLE_TLS
+
+#include "thread_pool.h"
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+static SSL_CTX *ctx = NULL;
+static thread_pool_t *handshake_pool = NULL; // Keeps handshakes off request workers
+static tls_dispatch_t dispatch_request = NULL;
+
+// Active session for each client socket, indexed by fd. A socket is only ever
+// owned by one thread at a time, the queue mutex orders the hand-offs
+static SSL *sessions[MAX_CONNECTIONS];
+
+static void tls_handshake(int client_socket);
+
+int tls_init(const char *cert_file, const char *key_file,
+             tls_dispatch_t dispatch) {
+  ctx = SSL_CTX_new(TLS_server_method());
+  if (ctx == NULL) {
+    ERR_print_errors_fp(stderr);
+    return -1;
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+  if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) <= 0 ||
+      SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) <= 0 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+    return -1;
+  }
+
+  // Hand the record layer to the kernel once the handshake is done so bulk
+  // data is encrypted without a copy through user space. OpenSSL falls back to
+  // user space crypto when the kernel or the cipher doesn't support it
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+
+  // Session resumption, returning clients skip the full handshake. Stateful
+  // cache for TLS 1.2 session ids, stateless tickets for everything else
+  const unsigned char sid_ctx[] = "httpCserver";
+  SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+  SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+  SSL_CTX_set_num_tickets(ctx, TLS_SESSION_TICKETS);
+
+  dispatch_request = dispatch;
+  handshake_pool = thread_pool_create(TLS_HANDSHAKE_THREADS, tls_handshake);
+  if (handshake_pool == NULL) {
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+int tls_enabled() { return ctx != NULL; }
+
+void tls_accept(int client_socket) {
+  if (client_socket >= MAX_CONNECTIONS) {
+    fprintf(stderr, "Socket %d exceeds MAX_CONNECTIONS\n", client_socket);
+    close(client_socket);
+    return;
+  }
+  thread_pool_add_task(handshake_pool, client_socket);
+}
+
+// Runs on the handshake pool, passes the socket on to the request workers
+static void tls_handshake(int client_socket) {
+  // Bound how long a slow or silent client can hold a handshake thread,
+  // keeping the timeouts the socket had for the request that follows
+  struct timeval rcv_timeout, snd_timeout;
+  socklen_t length = sizeof(struct timeval);
+  getsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &rcv_timeout, &length);
+  length = sizeof(struct timeval);
+  getsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &snd_timeout, &length);
+  struct timeval tv = {.tv_sec = TLS_HANDSHAKE_TIMEOUT, .tv_usec = 0};
+  setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  SSL *ssl = SSL_new(ctx);
+  if (ssl == NULL || SSL_set_fd(ssl, client_socket) != 1) {
+    ERR_print_errors_fp(stderr);
+    SSL_free(ssl);
+    close(client_socket);
+    return;
+  }
+
+  if (SSL_accept(ssl) != 1) {
+    ERR_print_errors_fp(stderr);
+    SSL_free(ssl);
+    close(client_socket);
+    return;
+  }
+
+  // Requests get the same I/O timeouts as over plain HTTP, inherited from
+  // the listening socket
+  setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &rcv_timeout,
+             sizeof(rcv_timeout));
+  setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &snd_timeout,
+             sizeof(snd_timeout));
+
+  printf("TLS handshake: %s %s, resumed: %s, kTLS tx: %s rx: %s\n",
+         SSL_get_version(ssl), SSL_get_cipher(ssl),
+         SSL_session_reused(ssl) ? "yes" : "no",
+         BIO_get_ktls_send(SSL_get_wbio(ssl)) ? "yes" : "no",
+         BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? "yes" : "no");
+
+  sessions[client_socket] = ssl;
+  dispatch_request(client_socket);
+}
+
+void tls_cleanup() {
+  if (handshake_pool != NULL) {
+    thread_pool_destroy(handshake_pool);
+    handshake_pool = NULL;
+  }
+  if (ctx != NULL) {
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+  }
+}
+
+// Map an OpenSSL result onto read()/write() semantics, on EAGAIN events says
+// which readiness the session needs before retrying
+static ssize_t tls_result(SSL *ssl, int ret, int *events) {
+  if (ret > 0) {
+    return ret;
+  }
+  switch (SSL_get_error(ssl, ret)) {
+  case SSL_ERROR_ZERO_RETURN:
+    return 0; // Peer sent close_notify
+  case SSL_ERROR_WANT_READ:
+    *events = EPOLLIN;
+    errno = EAGAIN;
+    return -1;
+  case SSL_ERROR_WANT_WRITE:
+    *events = EPOLLOUT;
+    errno = EAGAIN;
+    return -1;
+  case SSL_ERROR_SYSCALL:
+    if (errno == 0) {
+      errno = ECONNRESET;
+    }
+    return -1;
+  default:
+    errno = EIO;
+    return -1;
+  }
+}
+
+static ssize_t session_read(int client_socket, void *buf, size_t len,
+                            int *events) {
+  if (client_socket < MAX_CONNECTIONS && sessions[client_socket] != NULL) {
+    SSL *ssl = sessions[client_socket];
+    return tls_result(ssl, SSL_read(ssl, buf, len), events);
+  }
+  return read(client_socket, buf, len);
+}
+
+static ssize_t session_write(int client_socket, const void *buf, size_t len,
+                             int *events) {
+  if (client_socket < MAX_CONNECTIONS && sessions[client_socket] != NULL) {
+    SSL *ssl = sessions[client_socket];
+    return tls_result(ssl, SSL_write(ssl, buf, len), events);
+  }
+  return write(client_socket, buf, len);
+}
+
+static void session_close(int client_socket) {
+  if (client_socket < MAX_CONNECTIONS && sessions[client_socket] != NULL) {
+    SSL *ssl = sessions[client_socket];
+    sessions[client_socket] = NULL;
+    SSL_shutdown(ssl); // Send close_notify, don't wait for the peer's
+    SSL_free(ssl);
+  }
+}
+
+#else // Built without OpenSSL, only plaintext connections
+
+int tls_init(const char *cert_file, const char *key_file,
+             tls_dispatch_t dispatch) {
+  fprintf(stderr, "TLS support not compiled in, rebuild with -DENABLE_TLS\n");
+  return -1;
+}
+
+int tls_enabled() { return 0; }
+
+void tls_accept(int client_socket) { close(client_socket); }
+
+void tls_cleanup() {}
+
+static ssize_t session_read(int client_socket, void *buf, size_t len,
+                            int *events) {
+  return read(client_socket, buf, len);
+}
+
+static ssize_t session_write(int client_socket, const void *buf, size_t len,
+                             int *events) {
+  return write(client_socket, buf, len);
+}
+
+static void session_close(int client_socket) {}
+
+#endif
+
+// Inside a coroutine, park until the socket is ready and return 0 to retry.
+// On a pool thread the socket blocks, so EAGAIN means a timeout and is final
+static int conn_wait(int client_socket, int events) {
+  if (!coro_active()) {
+    return -1;
+  }
+  if (coro_await_fd(client_socket, events, CORO_IO_TIMEOUT_MS) != 0) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  return 0;
+}
+
+ssize_t conn_read(int client_socket, void *buf, size_t len) {
+  while (1) {
+    int events = EPOLLIN;
+    ssize_t n = session_read(client_socket, buf, len, &events);
+    if (n >= 0 || (errno != EINTR && errno != EAGAIN) ||
+        (errno == EAGAIN && conn_wait(client_socket, events) != 0)) {
+      return n;
+    }
+  }
+}
+
+// Write all of buf, returns len or -1 on error
+ssize_t conn_write(int client_socket, const void *buf, size_t len) {
+  size_t written = 0;
+  while (written < len) {
+    int events = EPOLLOUT;
+    ssize_t n = session_write(client_socket, (const char *)buf + written,
+                              len - written, &events);
+    if (n >= 0) {
+      written += n;
+    } else if ((errno != EINTR && errno != EAGAIN) ||
+               (errno == EAGAIN && conn_wait(client_socket, events) != 0)) {
+      return -1;
+    }
+  }
+  return written;
+}
+
+void conn_close(int client_socket) {
+  session_close(client_socket);
+  close(client_socket);
+}
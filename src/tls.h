@@ -0,0 +1,26 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+
+#define TLS_HANDSHAKE_THREADS 2
+#define TLS_HANDSHAKE_TIMEOUT 5   // Seconds a client gets to finish the handshake
+#define TLS_SESSION_CACHE_SIZE 1024
+#define TLS_SESSION_TIMEOUT 300   // Seconds a session/ticket can be resumed
+#define TLS_SESSION_TICKETS 2     // TLS 1.3 tickets issued per full handshake
+
+// Called with a client socket once its handshake has completed
+typedef void (*tls_dispatch_t)(int client_socket);
+
+int tls_init(const char *cert_file, const char *key_file,
+             tls_dispatch_t dispatch);
+int tls_enabled();
+void tls_accept(int client_socket);
+void tls_cleanup();
+
+// Connection I/O, goes through TLS when the socket has a session
+ssize_t conn_read(int client_socket, void *buf, size_t len);
+ssize_t conn_write(int client_socket, const void *buf, size_t len);
+void conn_close(int client_socket);
+
+#endif
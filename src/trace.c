@@ -0,0 +1,290 @@
+#include "trace.h"
+#include "http_server.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct trace_record {
+  uint64_t ts[TRACE_PHASES]; // Monotonic ns, 0 for phases never reached
+  char trace_id[33];
+  char span_id[17];   // This request's span
+  char parent_id[17]; // Caller's span from traceparent, empty otherwise
+  char name[64];      // "METHOD /path"
+  int status;
+};
+
+// Finished requests of one thread. Only that thread writes to it
+typedef struct trace_ring {
+  trace_record_t records[TRACE_RING_SIZE];
+  uint64_t count; // Records ever pushed, the newest is (count - 1) % size
+  int tid;
+  struct trace_ring *next;
+} trace_ring_t;
+
+static const char *trace_path = NULL; // NULL when tracing is off
+static int sample_rate = TRACE_SAMPLE_RATE;
+static unsigned int accepted = 0;
+
+// Open trace for each sampled client socket, indexed by fd. The socket's
+// hand-offs between threads order the accesses, like the TLS sessions
+static trace_record_t *records[MAX_CONNECTIONS];
+
+static __thread trace_ring_t *ring = NULL;
+static trace_ring_t *rings = NULL; // Every thread's ring, kept after it exits
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Span names, each runs from the previous phase reached to this one
+static const char *phase_names[TRACE_PHASES] = {
+    NULL, "dispatch", "queue", "read", "parse", "store", "write", "close"};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void random_hex(char *out, size_t bytes) {
+  unsigned char id[16];
+  if (getrandom(id, bytes, 0) != (ssize_t)bytes) {
+    uint64_t seed = now_ns(); // Unique enough to tell traces apart
+    memcpy(id, &seed, sizeof(seed));
+    memcpy(id + sizeof(seed), &seed, sizeof(seed));
+  }
+  for (size_t i = 0; i < bytes; i++) {
+    sprintf(out + i * 2, "%02x", id[i]);
+  }
+}
+
+static trace_record_t *record(int client_socket) {
+  if (trace_path == NULL || client_socket < 0 ||
+      client_socket >= MAX_CONNECTIONS) {
+    return NULL;
+  }
+  return records[client_socket];
+}
+
+int trace_init(const char *path, int rate) {
+  if (path == NULL || rate < 1) {
+    return -1;
+  }
+  trace_path = path;
+  sample_rate = rate;
+  return 0;
+}
+
+int trace_enabled() { return trace_path != NULL; }
+
+// Sampling is decided once per connection so a trace always has every phase
+void trace_accept(int client_socket) {
+  if (trace_path == NULL || client_socket < 0 ||
+      client_socket >= MAX_CONNECTIONS) {
+    return;
+  }
+  // A socket closed before it reached handle_client leaves its trace behind
+  free(records[client_socket]);
+  records[client_socket] = NULL;
+
+  if (__atomic_fetch_add(&accepted, 1, __ATOMIC_RELAXED) % sample_rate != 0) {
+    return;
+  }
+  trace_record_t *rec = calloc(1, sizeof(trace_record_t));
+  if (rec == NULL) {
+    return;
+  }
+  rec->ts[TRACE_ACCEPT] = now_ns();
+  random_hex(rec->trace_id, 16);
+  random_hex(rec->span_id, 8);
+  records[client_socket] = rec;
+}
+
+void trace_mark(int client_socket, trace_phase_t phase) {
+  trace_record_t *rec = record(client_socket);
+  if (rec != NULL) {
+    rec->ts[phase] = now_ns();
+  }
+}
+
+static int is_hex(const char *s, size_t length) {
+  int nonzero = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (!isxdigit((unsigned char)s[i]) || isupper((unsigned char)s[i])) {
+      return 0;
+    }
+    nonzero |= s[i] != '0';
+  }
+  return nonzero; // All zero ids are invalid
+}
+
+// Finds a valid version 00 traceparent in the request's header block,
+// "00-<32 hex trace id>-<16 hex parent id>-<2 hex flags>"
+static const char *find_traceparent(const char *request) {
+  const char *line = strstr(request, "\r\n");
+  while (line != NULL && strncmp(line, "\r\n\r\n", 4) != 0) {
+    line += 2;
+    if (strncasecmp(line, "traceparent:", 12) == 0) {
+      const char *value = line + 12;
+      while (*value == ' ' || *value == '\t') {
+        value++;
+      }
+      if (strncmp(value, "00-", 3) == 0 && is_hex(value + 3, 32) &&
+          value[35] == '-' && is_hex(value + 36, 16) && value[52] == '-' &&
+          isxdigit((unsigned char)value[53]) &&
+          isxdigit((unsigned char)value[54])) {
+        return value;
+      }
+      return NULL;
+    }
+    line = strstr(line, "\r\n");
+  }
+  return NULL;
+}
+
+int trace_context(int client_socket, const char *request, char *header,
+                  size_t size) {
+  const char *parent = find_traceparent(request);
+  trace_record_t *rec = record(client_socket);
+  if (rec == NULL) {
+    // Not sampled here, pass the caller's context through untouched
+    return parent ? snprintf(header, size, "traceparent: %.55s", parent) : 0;
+  }
+  if (parent != NULL) {
+    memcpy(rec->trace_id, parent + 3, 32);
+    memcpy(rec->parent_id, parent + 36, 16);
+  }
+  return snprintf(header, size, "traceparent: 00-%s-%s-01", rec->trace_id,
+                  rec->span_id);
+}
+
+void trace_describe(int client_socket, const char *method, const char *path,
+                    int status) {
+  trace_record_t *rec = record(client_socket);
+  if (rec == NULL) {
+    return;
+  }
+  snprintf(rec->name, sizeof(rec->name), "%s %s", method, path);
+  for (char *c = rec->name; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\' || iscntrl((unsigned char)*c)) {
+      *c = '_'; // Keep the JSON export free of escapes
+    }
+  }
+  rec->status = status;
+}
+
+trace_record_t *trace_detach(int client_socket) {
+  trace_record_t *rec = record(client_socket);
+  if (rec != NULL) {
+    records[client_socket] = NULL;
+  }
+  return rec;
+}
+
+void trace_finish(trace_record_t *rec) {
+  if (rec == NULL) {
+    return;
+  }
+  rec->ts[TRACE_CLOSE] = now_ns();
+
+  if (ring == NULL) {
+    ring = calloc(1, sizeof(trace_ring_t));
+    if (ring == NULL) {
+      free(rec);
+      return;
+    }
+    ring->tid = syscall(SYS_gettid);
+    pthread_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+  }
+  ring->records[ring->count % TRACE_RING_SIZE] = *rec;
+  __atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+  free(rec);
+}
+
+static void write_event(FILE *file, int *first, const char *name,
+                        const char *category, uint64_t start, uint64_t end,
+                        int tid) {
+  fprintf(file,
+          "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+          "\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+          *first ? "" : ",", name, category, start / 1000.0,
+          (end - start) / 1000.0, (int)getpid(), tid);
+  *first = 0;
+}
+
+// One complete event for the request, carrying its trace context, with a
+// nested event for every phase it went through
+static void write_record(FILE *file, int *first, const trace_record_t *rec,
+                         int tid) {
+  write_event(file, first, rec->name[0] ? rec->name : "request", "request",
+              rec->ts[TRACE_ACCEPT], rec->ts[TRACE_CLOSE], tid);
+  fprintf(file,
+          ",\"args\":{\"trace_id\":\"%s\",\"span_id\":\"%s\","
+          "\"parent_id\":\"%s\",\"status\":%d}}",
+          rec->trace_id, rec->span_id, rec->parent_id, rec->status);
+
+  uint64_t previous = rec->ts[TRACE_ACCEPT];
+  for (int phase = TRACE_ACCEPT + 1; phase < TRACE_PHASES; phase++) {
+    if (rec->ts[phase] == 0) {
+      continue;
+    }
+    write_event(file, first, phase_names[phase], "phase", previous,
+                rec->ts[phase], tid);
+    fprintf(file, "}");
+    previous = rec->ts[phase];
+  }
+}
+
+int trace_flush() {
+  if (trace_path == NULL) {
+    return 0;
+  }
+  FILE *file = fopen(trace_path, "w");
+  if (file == NULL) {
+    perror("Failed to open trace file");
+    return -1;
+  }
+
+  int first = 1, written = 0;
+  fprintf(file, "{\"traceEvents\":[");
+  pthread_mutex_lock(&rings_mutex);
+  for (trace_ring_t *r = rings; r != NULL; r = r->next) {
+    uint64_t count = __atomic_load_n(&r->count, __ATOMIC_ACQUIRE);
+    uint64_t oldest = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0;
+    for (uint64_t i = oldest; i < count; i++) {
+      write_record(file, &first, &r->records[i % TRACE_RING_SIZE], r->tid);
+      written++;
+    }
+  }
+  pthread_mutex_unlock(&rings_mutex);
+  fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+  if (fclose(file) != 0) {
+    perror("Failed to write trace file");
+    return -1;
+  }
+  printf("Wrote %d request traces to %s\n", written, trace_path);
+  return 0;
+}
+
+void trace_cleanup() {
+  pthread_mutex_lock(&rings_mutex);
+  while (rings != NULL) {
+    trace_ring_t *next = rings->next;
+    free(rings);
+    rings = next;
+  }
+  pthread_mutex_unlock(&rings_mutex);
+  for (int i = 0; i < MAX_CONNECTIONS; i++) {
+    free(records[i]);
+    records[i] = NULL;
+  }
+  trace_path = NULL;
+}
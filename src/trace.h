@@ -0,0 +1,51 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_SAMPLE_RATE 100 // Trace 1 in this many connections by default
+#define TRACE_RING_SIZE 1024  // Requests kept per thread, oldest overwritten
+#define TRACE_HEADER_SIZE 72  // "traceparent: " plus a version 00 value
+
+// Request phases, each gets a monotonic timestamp when it is reached.
+// Writes update the store inside parse_request, so for them TRACE_PARSED
+// covers the store access and TRACE_STORE is only marked for reads
+typedef enum {
+  TRACE_ACCEPT,   // accept() returned
+  TRACE_ENQUEUE,  // Handed to the pool or a reactor, after any TLS handshake
+  TRACE_DEQUEUE,  // A worker or coroutine picked it up
+  TRACE_READ,     // Whole request read
+  TRACE_PARSED,   // parse_request() returned
+  TRACE_STORE,    // Endpoint data copied out of the store
+  TRACE_WRITTEN,  // Response written
+  TRACE_CLOSE,    // Connection closed
+  TRACE_PHASES
+} trace_phase_t;
+
+int trace_init(const char *path, int sample_rate);
+int trace_enabled();
+void trace_accept(int client_socket);
+void trace_mark(int client_socket, trace_phase_t phase);
+
+// Adopts the request's traceparent header, if any, and fills header with the
+// traceparent to send back. Returns 0 when there is nothing to send
+int trace_context(int client_socket, const char *request, char *header,
+                  size_t size);
+void trace_describe(int client_socket, const char *method, const char *path,
+                    int status);
+
+typedef struct trace_record trace_record_t;
+
+// Takes the request's trace off the socket so the fd can be closed and
+// reused, NULL if it isn't sampled
+trace_record_t *trace_detach(int client_socket);
+
+// Stamps the close and records the trace on the calling thread's ring
+void trace_finish(trace_record_t *rec);
+
+// Writes every ring as Chrome trace event JSON, once request threads stopped
+int trace_flush();
+void trace_cleanup();
+
+#endif
@@ -0,0 +1,217 @@
+// Micro-benchmarks for parse, store get/put and serialize over a request
+// corpus. Reports ns/op, allocations/op and bytes allocated/op. The wrap
+// flags route the parser's allocations through the counters below:
+//
+//   gcc -O2 -Isrc test_utils/bench.c src/request_handler.c -lpthread
+//     -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc -o bench
+//   ./bench test_utils/corpus/* > baseline.txt
+//   ./bench -b baseline.txt test_utils/corpus/*   # fails on a regression
+#include "request_handler.h"
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_ITERATIONS 200000
+#define BENCH_TOLERANCE 20 // Percent slower than baseline before failing
+#define MAX_CORPUS 64
+
+static uint64_t alloc_count = 0;
+static uint64_t alloc_bytes = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  alloc_count++;
+  alloc_bytes += size;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+  alloc_count++;
+  alloc_bytes += count * size;
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  alloc_count++;
+  alloc_bytes += size;
+  return __real_realloc(ptr, size);
+}
+
+typedef struct {
+  char name[64];
+  double ns_per_op;
+  double allocs_per_op;
+  double bytes_per_op;
+} result_t;
+
+typedef void (*bench_fn_t)(void *arg);
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static result_t run(const char *name, bench_fn_t fn, void *arg,
+                    long iterations) {
+  result_t result;
+  snprintf(result.name, sizeof(result.name), "%s", name);
+
+  for (long i = 0; i < iterations / 100; i++) { // Warm up caches and store
+    fn(arg);
+  }
+  alloc_count = alloc_bytes = 0;
+  uint64_t start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    fn(arg);
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  result.ns_per_op = (double)elapsed / iterations;
+  result.allocs_per_op = (double)alloc_count / iterations;
+  result.bytes_per_op = (double)alloc_bytes / iterations;
+  printf("%-32s %12.1f ns/op %8.2f allocs/op %10.1f B/op\n", result.name,
+         result.ns_per_op, result.allocs_per_op, result.bytes_per_op);
+  return result;
+}
+
+static void bench_parse(void *arg) {
+  HttpRequest req = parse_request((const char *)arg);
+  (void)req;
+}
+
+static void bench_store_put(void *arg) {
+  static const char body[] = "{\"name\": \"John\", \"age\": 30}";
+  store_endpoint_data(*(int *)arg, body, sizeof(body) - 1);
+}
+
+static void bench_store_get(void *arg) {
+  int index = find_or_create_endpoint((const char *)arg);
+  free(get_endpoint_data(index));
+}
+
+static void bench_serialize(void *arg) {
+  const char *headers[] = {"Content-Type: text/plain", "Server: MyServer/1.0"};
+  HttpResponse *response = create_response(200, headers, 2);
+  set_response_body(response, (const char *)arg, strlen((const char *)arg));
+  add_response_header(response, "Content-Length: 48");
+  size_t length;
+  free(serialize_response(response, &length));
+  free_response(response);
+}
+
+static char *read_file(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *data = malloc(size + 1);
+  if (data != NULL) {
+    data[fread(data, 1, size, file)] = '\0';
+  }
+  fclose(file);
+  return data;
+}
+
+// Compare against a saved run, returns the number of regressions
+static int check_baseline(const char *path, result_t *results, int count,
+                          int tolerance) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror(path);
+    return 1;
+  }
+  int regressions = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    result_t base;
+    if (sscanf(line, "%63s %lf ns/op %lf allocs/op", base.name,
+               &base.ns_per_op, &base.allocs_per_op) != 3) {
+      continue;
+    }
+    for (int i = 0; i < count; i++) {
+      if (strcmp(results[i].name, base.name) != 0) {
+        continue;
+      }
+      if (results[i].ns_per_op > base.ns_per_op * (100 + tolerance) / 100) {
+        fprintf(stderr, "REGRESSION %s: %.1f ns/op, baseline %.1f\n",
+                base.name, results[i].ns_per_op, base.ns_per_op);
+        regressions++;
+      }
+      if (results[i].allocs_per_op > base.allocs_per_op + 0.005) {
+        fprintf(stderr, "REGRESSION %s: %.2f allocs/op, baseline %.2f\n",
+                base.name, results[i].allocs_per_op, base.allocs_per_op);
+        regressions++;
+      }
+    }
+  }
+  fclose(file);
+  return regressions;
+}
+
+int main(int argc, char *argv[]) {
+  long iterations = BENCH_ITERATIONS;
+  int tolerance = BENCH_TOLERANCE;
+  const char *baseline = NULL;
+
+  int opt_char;
+  while ((opt_char = getopt(argc, argv, "n:b:t:")) != -1) {
+    switch (opt_char) {
+    case 'n':
+      iterations = atol(optarg);
+      break;
+    case 'b':
+      baseline = optarg;
+      break;
+    case 't':
+      tolerance = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-n iterations] [-b baseline [-t percent]] "
+              "corpus...\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (optind == argc || iterations <= 0) {
+    fprintf(stderr, "No corpus files given\n");
+    return 1;
+  }
+
+  result_t results[MAX_CORPUS + 3];
+  int count = 0;
+  for (int i = optind; i < argc && count < MAX_CORPUS; i++) {
+    char *request = read_file(argv[i]);
+    if (request == NULL) {
+      return 1;
+    }
+    const char *base = strrchr(argv[i], '/');
+    char name[64];
+    snprintf(name, sizeof(name), "parse/%s", base ? base + 1 : argv[i]);
+    results[count++] = run(name, bench_parse, request, iterations);
+    free(request);
+    free_endpoint_data(); // Each file starts from an empty store
+  }
+
+  int index = find_or_create_endpoint("/bench");
+  results[count++] = run("store/put", bench_store_put, &index, iterations);
+  results[count++] = run("store/get", bench_store_get, "/bench", iterations);
+  results[count++] = run("serialize", bench_serialize,
+                         "{\"name\": \"John\", \"age\": 30, \"city\": \"NY\"}",
+                         iterations);
+  free_endpoint_data();
+
+  if (baseline != NULL &&
+      check_baseline(baseline, results, count, tolerance) > 0) {
+    return 1;
+  }
+  return 0;
+}
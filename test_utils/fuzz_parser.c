@@ -0,0 +1,92 @@
+// Fuzz target for the request parser, chunked decoding and serialization.
+//
+// libFuzzer:
+//   clang -g -O1 -fsanitize=fuzzer,address,undefined -Isrc
+//     test_utils/fuzz_parser.c src/request_handler.c -lpthread -o fuzz_parser
+//   ./fuzz_parser test_utils/corpus
+//
+// AFL++ / corpus replay (reads each file argument, or stdin):
+//   afl-clang-fast -g -fsanitize=address -DFUZZ_STANDALONE -Isrc
+//     test_utils/fuzz_parser.c src/request_handler.c -lpthread -o fuzz_parser
+//   afl-fuzz -i test_utils/corpus -o findings -- ./fuzz_parser
+#include "request_handler.h"
+#include <stdint.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  // The server always hands the parser a null terminated buffer
+  char *request = malloc(size + 1);
+  if (request == NULL) {
+    return 0;
+  }
+  memcpy(request, data, size);
+  request[size] = '\0';
+  size_t length = strlen(request);
+
+  request_complete(request, length);
+
+  char *decoded = malloc(size + 1);
+  if (decoded != NULL) {
+    decode_chunked((const char *)data, size, decoded);
+    free(decoded);
+  }
+
+  HttpRequest req = parse_request(request);
+
+  // Build the response the way handle_client does
+  const char *headers[] = {"Content-Type: text/plain", "Server: MyServer/1.0"};
+  HttpResponse *response = create_response(req.response_code, headers, 2);
+  if (response != NULL) {
+    int index = find_or_create_endpoint(req.path);
+    char *endpoint_data = index != -1 ? get_endpoint_data(index) : NULL;
+    if (endpoint_data != NULL) {
+      set_response_body(response, endpoint_data, strlen(endpoint_data));
+      free(endpoint_data);
+    }
+    add_response_header(response, "Content-Length: 0");
+
+    size_t response_length;
+    free(serialize_response(response, &response_length));
+    free_response(response);
+  }
+
+  // Start every input with an empty store
+  free_endpoint_data();
+  free(request);
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+static void run_file(FILE *file) {
+  size_t capacity = 4096, size = 0;
+  uint8_t *data = malloc(capacity);
+  size_t n;
+  while (data != NULL && (n = fread(data + size, 1, capacity - size, file)) > 0) {
+    size += n;
+    if (size == capacity) {
+      capacity *= 2;
+      data = realloc(data, capacity);
+    }
+  }
+  if (data != NULL) {
+    LLVMFuzzerTestOneInput(data, size);
+  }
+  free(data);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    run_file(stdin);
+    return 0;
+  }
+  for (int i = 1; i < argc; i++) {
+    FILE *file = fopen(argv[i], "rb");
+    if (file == NULL) {
+      perror(argv[i]);
+      return 1;
+    }
+    run_file(file);
+    fclose(file);
+  }
+  return 0;
+}
+#endif